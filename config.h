@@ -26,6 +26,11 @@
 	"corners.rep", \
 	"short2.rep", \
 	"malloc.rep", \
+	"align.rep", \
+	"batch.rep", \
+	"sized.rep", \
+	"remap.rep", \
+	"cacheline.rep", \
 	"binary-bal.rep", \
 	"coalescing-bal.rep", \
 	"fs.rep", \
@@ -10,6 +10,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -18,6 +19,11 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#  include <linux/perf_event.h>
+#endif
 
 #ifndef __GCC__
 #  define __attribute__(args)
@@ -36,10 +42,16 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define HANDOFF_SLOTS 256 /* blocks in flight between two threads (-X) */
+#define CACHE_LINE      64 /* bytes per cache line (-C, c requests) */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
+/* Returns true if the size bytes at p touch more than one cache line */
+#define STRADDLES(p, size) \
+	((((unsigned long)(p)) ^ ((unsigned long)(p) + (size) - 1)) >= CACHE_LINE)
+
 /******************************
  * The key compound data types
  *****************************/
@@ -61,9 +73,12 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-	enum { ALLOC, FREE, REALLOC } type; /* type of request */
+	enum { ALLOC, FREE, REALLOC, MEMALIGN, CACHELINE,
+		BATCH_ALLOC, BATCH_FREE, SIZED_FREE } type; /* type of request */
 	int index;                        /* index for free() to use later */
 	size_t size;                      /* byte size of alloc/realloc request */
+	size_t align;                     /* alignment of a memalign request */
+	int count;                        /* blocks index.. of a batch request */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -89,6 +104,30 @@ typedef struct {
 	range_t *ranges;
 } speed_t;
 
+/*
+ * Single producer, single consumer ring of blocks that one replay
+ * thread hands to the next one to free (-X)
+ */
+typedef struct {
+	char *slots[HANDOFF_SLOTS];
+	unsigned int head;  /* next slot to free; written by the consumer */
+	unsigned int tail;  /* next slot to fill; written by the producer */
+} handoff_t;
+
+/*
+ * Holds the params to eval_mm_thread: one thread's replay of a trace,
+ * with its own copy of the block pointers.
+ */
+typedef struct {
+	trace_t *trace;
+	char **blocks;
+	pthread_barrier_t *start;
+	handoff_t inbox;    /* blocks the previous thread allocated (-X) */
+	handoff_t *outbox;  /* inbox of the thread that frees our blocks */
+	int errors;      /* corrupted blocks seen by this thread */
+	int failed;      /* set if the heap ran out during the replay */
+} thread_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
 	/* set in read_trace */
@@ -102,6 +141,15 @@ typedef struct {
 
 	/* defined only for the student malloc package */
 	double util;     /* space utilization for this trace (always 0 for libc) */
+	double mt_secs;  /* secs for num_threads concurrent replays (-T) */
+	double heap_peak;  /* largest heap size during the util run */
+	double heap_avg;   /* heap size averaged over the ops of the util run */
+	double heap_end;   /* heap size after the last op of the util run */
+	unsigned long extends; /* heap extensions during the util run */
+	size_t extend_size;    /* bytes per extension at the end of the util run */
+	unsigned long probes;  /* free blocks looked at by fit searches in the util run */
+	long long dtlb_misses; /* dTLB load misses in one speed run, -1 if unknown */
+	long long dtlb_base;   /* the same on base pages, when -H asks for huge ones */
 
 	/* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -160,6 +208,38 @@ int onetime_flag = 0;
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* number of threads for the concurrent replay; 0 skips it (-T) */
+static int num_threads = 0;
+
+/* number of arenas for the concurrent replay, and whether threads pick
+   them by CPU rather than round robin (-a, -P) */
+static int num_arenas = 1;
+static int arenas_by_cpu = 0;
+
+/* if set, each replay thread frees the blocks of its neighbour (-X) */
+static int cross_free = 0;
+
+/* requests above this many bytes are mapped; -1 keeps mm.c's default (-M) */
+static long mmap_threshold = -1;
+
+/* free blocks probed past the first fit; -1 keeps mm.c's default (-K) */
+static int fit_probes = -1;
+
+/* if set, mm.c keeps its free lists in address order (-O) */
+static int addr_order = 0;
+
+/* if set, mm.c keeps successor sizes in the free list links (-Z) */
+static int packed_sizes = 0;
+
+/* if set, small blocks must not straddle a cache line (-C) */
+static int cacheline_slabs = 0;
+
+/* if set, the heap is backed by transparent huge pages (-H) */
+static int huge_pages = 0;
+
+/* if set, batch and sized requests are replayed as plain calls (-S) */
+static int split_batches = 0;
+
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -197,11 +277,21 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static double eval_mm_threads(trace_t *trace, int nthreads);
+static void *eval_mm_thread(void *ptr);
+static void handoff_drain(handoff_t *h);
+static int batch_malloc(char **out, size_t size, int n);
+static void batch_free(char **ptrs, int n);
+static void sized_free(void *p, size_t size);
+static long long count_dtlb_misses(void (*f)(void *), void *arg);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printthreadresults(int n, stats_t *stats);
+static void printheapresults(int n, stats_t *stats);
+static void format_count(char *buf, long long count);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
 	__attribute__((format(printf, 3,4)));
@@ -250,12 +340,23 @@ static void run_tests(int num_tracefiles, const char *tracedir,
 		if (mm_stats[i].valid) {
 			if (verbose > 1)
 				printf("efficiency, ");
-			mm_stats[i].util = eval_mm_util(trace, i);
+			mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i]);
 			speed_params->trace = trace;
 			speed_params->ranges = ranges;
 			if (verbose > 1)
 				printf("and performance.\n");
 			mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+			if (huge_pages) {
+				/* once on each page size, each from an empty heap */
+				mem_reset_brk();
+				mem_set_hugepages(0);
+				mm_stats[i].dtlb_base = count_dtlb_misses(eval_mm_speed, speed_params);
+				mem_reset_brk();
+				mem_set_hugepages(1);
+			}
+			mm_stats[i].dtlb_misses = count_dtlb_misses(eval_mm_speed, speed_params);
+			if (num_threads > 0)
+				mm_stats[i].mt_secs = eval_mm_threads(trace, num_threads);
 		}
 		free_trace(trace);
 	}
@@ -291,7 +392,7 @@ int main(int argc, char **argv)
 	/*
 	 * Read and interpret the command line arguments
 	 */
-	while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlD")) != EOF) {
+	while ((c = getopt(argc, argv, "d:f:c:s:t:v:T:a:M:K:hVAlCDHOPSXZ")) != EOF) {
 		switch (c) {
 
 			case 'A': /* Hidden Autolab driver argument */
@@ -349,6 +450,50 @@ int main(int argc, char **argv)
 				set_timeout = atoi(optarg);
 				break;
 
+			case 'T': /* Also replay each trace in n threads at once */
+				num_threads = atoi(optarg);
+				break;
+
+			case 'a': /* Split the heap into n arenas for the -T replay */
+				num_arenas = atoi(optarg);
+				break;
+
+			case 'P': /* Bind threads to arenas by CPU */
+				arenas_by_cpu = 1;
+				break;
+
+			case 'X': /* Free every block in a different thread */
+				cross_free = 1;
+				break;
+
+			case 'M': /* Map requests above this many bytes */
+				mmap_threshold = atol(optarg);
+				break;
+
+			case 'K': /* Probe this many blocks past the first fit */
+				fit_probes = atoi(optarg);
+				break;
+
+			case 'O': /* Address-ordered free lists */
+				addr_order = 1;
+				break;
+
+			case 'S': /* Replay batch and sized requests as plain calls */
+				split_batches = 1;
+				break;
+
+			case 'C': /* Small blocks within a cache line */
+				cacheline_slabs = 1;
+				break;
+
+			case 'H': /* Huge page backed heap */
+				huge_pages = 1;
+				break;
+
+			case 'Z': /* Packed size copies in free blocks */
+				packed_sizes = 1;
+				break;
+
 			case 'h': /* Print this message */
 				usage();
 				exit(0);
@@ -369,6 +514,14 @@ int main(int argc, char **argv)
 		init_random_data();
 	}
 
+	if (mmap_threshold >= 0)
+		mm_set_mmap_threshold(mmap_threshold);
+	if (fit_probes >= 0)
+		mm_set_fit_probes(fit_probes);
+	mm_set_addr_order(addr_order);
+	mm_set_packed_sizes(packed_sizes);
+	mm_set_cacheline_slabs(cacheline_slabs);
+
 	/* Initialize the timing package */
 	init_fsecs();
 
@@ -426,6 +579,8 @@ int main(int argc, char **argv)
 
 	/* Initialize the simulated memory system in memlib.c */
 	mem_init();
+	if (mem_set_hugepages(huge_pages) < 0 && huge_pages)
+		fprintf(stderr, "Warning: huge pages not supported, using base pages\n");
 
 	run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
 			ranges, &speed_params);
@@ -444,6 +599,17 @@ int main(int argc, char **argv)
 			printf("\nResults for mm malloc:\n");
 			printresults(num_tracefiles, mm_stats);
 			printf("\n");
+			printf("Heap size over time for mm malloc, on %s pages:\n",
+					huge_pages ? "2 MB" : "base");
+			printheapresults(num_tracefiles, mm_stats);
+			printf("\n");
+			if (num_threads > 0) {
+				printf("Results for mm malloc with %d threads, %d arenas%s%s:\n",
+						num_threads, num_arenas, arenas_by_cpu ? " by CPU" : "",
+						cross_free ? ", cross-thread frees" : "");
+				printthreadresults(num_tracefiles, mm_stats);
+				printf("\n");
+			}
 		}
 	}
 
@@ -532,11 +698,24 @@ int main(int argc, char **argv)
 static int add_range(range_t **ranges, char *lo, int size,
 		const trace_t *trace, int opnum, int index)
 {
-	char *hi = lo + size - 1;
+	char *hi;
+	size_t usable;
 	range_t *p;
 
 	assert(size > 0);
 
+	/* The block must hold at least size bytes.  Every byte that
+	   mm_malloc_usable_size reports is the caller's to use, so the checks
+	   below cover all of them. */
+	usable = mm_malloc_usable_size(lo);
+	if (usable < size) {
+		malloc_error(trace, opnum,
+				"Usable size %lu of payload (%p) is less than %d bytes",
+				(unsigned long)usable, lo, size);
+		return 0;
+	}
+	hi = lo + usable - 1;
+
 	/* Payload addresses must be ALIGNMENT-byte aligned */
 	if (!IS_ALIGNED(lo)) {
 		malloc_error(trace, opnum,
@@ -544,9 +723,11 @@ static int add_range(range_t **ranges, char *lo, int size,
 		return 0;
 	}
 
-	/* The payload must lie within the extent of the heap */
-	if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-			(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+	/* The payload must lie within the extent of the heap, or
+	   within a single region the package mapped for it */
+	if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+			(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+			!mem_mapped(lo, hi)) {
 		malloc_error(trace, opnum,
 				"Payload (%p:%p) lies outside heap (%p:%p)",
 				lo, hi, mem_heap_lo(), mem_heap_hi());
@@ -694,7 +875,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 	FILE *tracefile;
 	trace_t *trace;
 	char type[MAXLINE];
-	int index, size;
+	int index, size, align, count;
 	int max_index = 0;
 	int op_index;
 
@@ -763,6 +944,44 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 				trace->ops[op_index].size = size;
 				max_index = (index > max_index) ? index : max_index;
 				break;
+			case 'm': /* m <index> <size> <align> */
+				assert(3 == fscanf(tracefile, "%u %u %u", &index, &size, &align));
+				if (align == 0 || (align & (align - 1)) != 0 || align % sizeof(void *) != 0)
+					app_error("%s: alignment %d is not a power of two multiple of %d",
+							trace->filename, align, (int)sizeof(void *));
+				trace->ops[op_index].type = MEMALIGN;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].size = size;
+				trace->ops[op_index].align = align;
+				max_index = (index > max_index) ? index : max_index;
+				break;
+			case 'c': /* c <index> <size> */
+				assert(2 == fscanf(tracefile, "%u %u", &index, &size));
+				trace->ops[op_index].type = CACHELINE;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].size = size;
+				max_index = (index > max_index) ? index : max_index;
+				break;
+			case 'A': /* A <index> <count> <size> */
+				assert(3 == fscanf(tracefile, "%u %u %u", &index, &count, &size));
+				trace->ops[op_index].type = BATCH_ALLOC;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].count = count;
+				trace->ops[op_index].size = size;
+				max_index = (index + count - 1 > max_index) ? index + count - 1 : max_index;
+				break;
+			case 'F': /* F <index> <count> */
+				assert(2 == fscanf(tracefile, "%u %u", &index, &count));
+				trace->ops[op_index].type = BATCH_FREE;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].count = count;
+				break;
+			case 's': /* s <index> <size> */
+				assert(2 == fscanf(tracefile, "%u %u", &index, &size));
+				trace->ops[op_index].type = SIZED_FREE;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].size = size;
+				break;
 			case 'f':
 				assert(1 == fscanf(tracefile, "%ud", &index));
 				trace->ops[op_index].type = FREE;
@@ -820,7 +1039,7 @@ static void free_trace(trace_t *trace)
  */
 static int eval_mm_valid(trace_t *trace, range_t **ranges)
 {
-	int i;
+	int i, j, n;
 	int index;
 	size_t size;
 	char *newp;
@@ -874,6 +1093,11 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 				 */
 				if (add_range(ranges, p, size, trace, i, index) == 0)
 					return 0;
+				if (cacheline_slabs && size <= CACHE_LINE && STRADDLES(p, size)) {
+					malloc_error(trace, i, "Payload (%p) of %d bytes straddles "
+							"a cache line", p, size);
+					return 0;
+				}
 
 				/* Remember region */
 				trace->blocks[index] = p;
@@ -883,6 +1107,85 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 				randomize_block(trace, index);
 				break;
 
+			case CACHELINE: /* mm_malloc_cacheline */
+				if ((p = mm_malloc_cacheline(size)) == NULL) {
+					malloc_error(trace, i, "mm_malloc_cacheline failed.");
+					return 0;
+				}
+
+				/* add_range covers every usable byte, so the block's
+				   lines are its own once it starts on one */
+				if ((unsigned long)p % CACHE_LINE != 0) {
+					malloc_error(trace, i,
+							"Payload address (%p) not aligned to %d bytes",
+							p, CACHE_LINE);
+					return 0;
+				}
+				if (mm_malloc_usable_size(p) < (size + CACHE_LINE-1) / CACHE_LINE * CACHE_LINE) {
+					malloc_error(trace, i, "Payload (%p) shares its last cache line", p);
+					return 0;
+				}
+				if (add_range(ranges, p, size, trace, i, index) == 0)
+					return 0;
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+				randomize_block(trace, index);
+				break;
+
+			case MEMALIGN: /* mm_posix_memalign */
+				if (mm_posix_memalign((void **)&p, trace->ops[i].align, size) != 0) {
+					malloc_error(trace, i, "mm_posix_memalign failed.");
+					return 0;
+				}
+
+				/* The payload must honour the requested alignment on top of
+				   everything add_range checks */
+				if ((unsigned long)p % trace->ops[i].align != 0) {
+					malloc_error(trace, i,
+							"Payload address (%p) not aligned to %d bytes",
+							p, (int)trace->ops[i].align);
+					return 0;
+				}
+				if (add_range(ranges, p, size, trace, i, index) == 0)
+					return 0;
+
+				/* Remember region */
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+
+				/* Set to random data, for debugging. */
+				randomize_block(trace, index);
+				break;
+
+			case BATCH_ALLOC: /* mm_malloc_batch */
+				n = trace->ops[i].count;
+				if (batch_malloc(&trace->blocks[index], size, n) != n) {
+					malloc_error(trace, i, "mm_malloc_batch failed.");
+					return 0;
+				}
+				for (j = index; j < index + n; j++) {
+					if (add_range(ranges, trace->blocks[j], size, trace, i, j) == 0)
+						return 0;
+					if (cacheline_slabs && size <= CACHE_LINE &&
+							STRADDLES(trace->blocks[j], size)) {
+						malloc_error(trace, i, "Payload (%p) of %d bytes straddles "
+								"a cache line", trace->blocks[j], size);
+						return 0;
+					}
+					trace->block_sizes[j] = size;
+					randomize_block(trace, j);
+				}
+				break;
+
+			case BATCH_FREE: /* mm_free_batch */
+				n = trace->ops[i].count;
+				for (j = index; j < index + n; j++) {
+					check_index(trace, i, j);
+					remove_range(ranges, trace->blocks[j]);
+				}
+				batch_free(&trace->blocks[index], n);
+				break;
+
 			case REALLOC: /* mm_realloc */
 				check_index(trace, i, index);
 
@@ -907,6 +1210,11 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 				if (size > 0) {
 					if(add_range(ranges, newp, size, trace, i, index) == 0)
 						return 0;
+					if (cacheline_slabs && size <= CACHE_LINE && STRADDLES(newp, size)) {
+						malloc_error(trace, i, "Payload (%p) of %d bytes straddles "
+								"a cache line", newp, size);
+						return 0;
+					}
 				}
 
 
@@ -923,6 +1231,16 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 				randomize_block(trace, index);
 				break;
 
+			case SIZED_FREE: /* mm_free_sized */
+				check_index(trace, i, index);
+				if (size != trace->block_sizes[index]) {
+					malloc_error(trace, i, "sized free of a block of another size.");
+					return 0;
+				}
+				remove_range(ranges, trace->blocks[index]);
+				sized_free(trace->blocks[index], size);
+				break;
+
 			case FREE: /* mm_free */
 				check_index(trace, i, index);
 
@@ -951,19 +1269,21 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   largest size the heap reached while running the student's malloc
+ *   package on the trace.  mem_shrink() lets the package shrink the
+ *   heap, so the peak, average and final heap sizes are also recorded
+ *   in stats.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats)
 {
-	int i;
+	int i, j, n;
 	int index;
 	int size, newsize, oldsize;
 	int max_total_size = 0;
+	double heap_size, heap_peak = 0, heap_sum = 0;
+	mm_stats_t mm_stats;
 	int total_size = 0;
 	char *p;
 	char *newp, *oldp;
@@ -994,6 +1314,63 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 				total_size += size;
 				break;
 
+			case CACHELINE: /* mm_malloc_cacheline */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+
+				if ((p = mm_malloc_cacheline(size)) == NULL) {
+					app_error("trace %d: mm_malloc_cacheline failed in eval_mm_util",
+							tracenum);
+				}
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+
+				total_size += size;
+				break;
+
+			case MEMALIGN: /* mm_memalign */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+
+				if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+					app_error("trace %d: mm_memalign failed in eval_mm_util",
+							tracenum);
+				}
+
+				/* Remember region and size */
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+
+				total_size += size;
+				break;
+
+			case BATCH_ALLOC: /* mm_malloc_batch */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				n = trace->ops[i].count;
+
+				if (batch_malloc(&trace->blocks[index], size, n) != n) {
+					app_error("trace %d: mm_malloc_batch failed in eval_mm_util",
+							tracenum);
+				}
+
+				/* Remember sizes */
+				for (j = index; j < index + n; j++)
+					trace->block_sizes[j] = size;
+
+				total_size += n * size;
+				break;
+
+			case BATCH_FREE: /* mm_free_batch */
+				index = trace->ops[i].index;
+				n = trace->ops[i].count;
+
+				batch_free(&trace->blocks[index], n);
+
+				for (j = index; j < index + n; j++)
+					total_size -= trace->block_sizes[j];
+				break;
+
 			case REALLOC: /* mm_realloc */
 				index = trace->ops[i].index;
 				newsize = trace->ops[i].size;
@@ -1012,6 +1389,13 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 				total_size += (newsize - oldsize);
 				break;
 
+			case SIZED_FREE: /* mm_free_sized */
+				index = trace->ops[i].index;
+				size = trace->block_sizes[index];
+				sized_free(trace->blocks[index], size);
+				total_size -= size;
+				break;
+
 			case FREE: /* mm_free */
 				index = trace->ops[i].index;
 				if(index < 0) {
@@ -1035,12 +1419,25 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 		/* update the high-water mark */
 		max_total_size = (total_size > max_total_size) ?
 			total_size : max_total_size;
+
+		/* track the heap size over time */
+		heap_size = (double)(mem_heapsize() + mem_mapsize());
+		heap_peak = (heap_size > heap_peak) ? heap_size : heap_peak;
+		heap_sum += heap_size;
 	}
 
+	stats->heap_peak = heap_peak;
+	stats->heap_avg = (trace->num_ops > 0) ? heap_sum / trace->num_ops : 0;
+	stats->heap_end = (double)(mem_heapsize() + mem_mapsize());
+	mm_get_stats(&mm_stats);
+	stats->extends = mm_stats.extends;
+	stats->extend_size = mm_stats.extend_size;
+	stats->probes = mm_stats.probes;
+
 	printf("max_total_size = %f\n", (double)max_total_size);
-	printf("mem_heapsize = %f\n", (double)mem_heapsize());
+	printf("mem_heapsize = %f\n", heap_peak);
 	
-	return ((double)max_total_size / (double)mem_heapsize());
+	return ((double)max_total_size / heap_peak);
 }
 
 
@@ -1072,6 +1469,35 @@ static void eval_mm_speed(void *ptr)
 				trace->blocks[index] = p;
 				break;
 
+			case CACHELINE: /* mm_malloc_cacheline */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				if ((p = mm_malloc_cacheline(size)) == NULL)
+					app_error("mm_malloc_cacheline error in eval_mm_speed");
+				trace->blocks[index] = p;
+				break;
+
+			case MEMALIGN: /* mm_memalign */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+					app_error("mm_memalign error in eval_mm_speed");
+				trace->blocks[index] = p;
+				break;
+
+			case BATCH_ALLOC: /* mm_malloc_batch */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				if (batch_malloc(&trace->blocks[index], size,
+							trace->ops[i].count) != trace->ops[i].count)
+					app_error("mm_malloc_batch error in eval_mm_speed");
+				break;
+
+			case BATCH_FREE: /* mm_free_batch */
+				index = trace->ops[i].index;
+				batch_free(&trace->blocks[index], trace->ops[i].count);
+				break;
+
 			case REALLOC: /* mm_realloc */
 				index = trace->ops[i].index;
 				newsize = trace->ops[i].size;
@@ -1081,6 +1507,11 @@ static void eval_mm_speed(void *ptr)
 				trace->blocks[index] = newp;
 				break;
 
+			case SIZED_FREE: /* mm_free_sized */
+				index = trace->ops[i].index;
+				sized_free(trace->blocks[index], trace->ops[i].size);
+				break;
+
 			case FREE: /* mm_free */
 				index = trace->ops[i].index;
 				if(index < 0) {
@@ -1096,6 +1527,273 @@ static void eval_mm_speed(void *ptr)
 		}
 }
 
+/*
+ * eval_mm_threads - Replay the trace in nthreads threads at once, each
+ *    with its own set of blocks, against the thread-safe mm package.
+ *    Returns the wall clock seconds from the common start to the last
+ *    thread finishing, or -1 if the heap could not hold all replays.
+ */
+static double eval_mm_threads(trace_t *trace, int nthreads)
+{
+	pthread_t *tids;
+	thread_t *args;
+	pthread_barrier_t start;
+	struct timespec t0, t1;
+	int i, corrupted = 0, failed = 0;
+
+	if ((tids = calloc(nthreads, sizeof(*tids))) == NULL ||
+			(args = calloc(nthreads, sizeof(*args))) == NULL)
+		unix_error("calloc failed in eval_mm_threads");
+
+	mem_reset_brk();
+	mm_set_threaded(1);
+	mm_set_arenas(num_arenas, arenas_by_cpu);
+	if (mm_init() < 0)
+		app_error("mm_init failed in eval_mm_threads");
+
+	pthread_barrier_init(&start, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		args[i].trace = trace;
+		args[i].start = &start;
+		args[i].outbox = cross_free ? &args[(i+1) % nthreads].inbox : NULL;
+		if ((args[i].blocks = calloc(trace->num_ids, sizeof(char *))) == NULL)
+			unix_error("calloc failed in eval_mm_threads");
+		if (pthread_create(&tids[i], NULL, eval_mm_thread, &args[i]) != 0)
+			unix_error("pthread_create failed in eval_mm_threads");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_barrier_wait(&start);
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+		corrupted += args[i].errors;
+		failed |= args[i].failed;
+		free(args[i].blocks);
+	}
+	/* blocks handed to a thread after it finished */
+	for (i = 0; i < nthreads; i++)
+		handoff_drain(&args[i].inbox);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	pthread_barrier_destroy(&start);
+	mm_set_threaded(0);
+
+	if (corrupted)
+		malloc_error(trace, 0, "%d blocks corrupted with %d threads",
+				corrupted, nthreads);
+	free(tids);
+	free(args);
+	if (failed)
+		return -1;
+	return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+/*
+ * eval_mm_thread - One thread of eval_mm_threads.  The first payload
+ *    byte of every block is stamped with its index and checked again
+ *    when the block is reallocated or freed.  With -X the block is then
+ *    handed to the next thread to free, unless its inbox is full.
+ */
+static void *eval_mm_thread(void *ptr)
+{
+	thread_t *t = (thread_t *)ptr;
+	trace_t *trace = t->trace;
+	int i, j, index, size;
+	char *p;
+
+	pthread_barrier_wait(t->start);
+	for (i = 0;  i < trace->num_ops;  i++) {
+		index = trace->ops[i].index;
+		size = trace->ops[i].size;
+		switch (trace->ops[i].type) {
+
+			case ALLOC: /* mm_malloc */
+				if ((p = mm_malloc(size)) == NULL) {
+					t->failed = 1;
+					return NULL;
+				}
+				p[0] = (char)index;
+				t->blocks[index] = p;
+				break;
+
+			case CACHELINE: /* mm_malloc_cacheline */
+				if ((p = mm_malloc_cacheline(size)) == NULL) {
+					t->failed = 1;
+					return NULL;
+				}
+				if ((unsigned long)p % CACHE_LINE != 0)
+					t->errors++;
+				p[0] = (char)index;
+				t->blocks[index] = p;
+				break;
+
+			case MEMALIGN: /* mm_memalign */
+				if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+					t->failed = 1;
+					return NULL;
+				}
+				if ((unsigned long)p % trace->ops[i].align != 0)
+					t->errors++;
+				p[0] = (char)index;
+				t->blocks[index] = p;
+				break;
+
+			case BATCH_ALLOC: /* mm_malloc_batch */
+				if (batch_malloc(&t->blocks[index], size,
+							trace->ops[i].count) != trace->ops[i].count) {
+					t->failed = 1;
+					return NULL;
+				}
+				for (j = index; j < index + trace->ops[i].count; j++)
+					t->blocks[j][0] = (char)j;
+				break;
+
+			case BATCH_FREE: /* mm_free_batch */
+				for (j = index; j < index + trace->ops[i].count; j++)
+					if (t->blocks[j][0] != (char)j)
+						t->errors++;
+				batch_free(&t->blocks[index], trace->ops[i].count);
+				handoff_drain(&t->inbox);
+				break;
+
+			case REALLOC: /* mm_realloc */
+				p = t->blocks[index];
+				if (p != NULL && p[0] != (char)index)
+					t->errors++;
+				if ((p = mm_realloc(p, size)) == NULL && size != 0) {
+					t->failed = 1;
+					return NULL;
+				}
+				if (p != NULL && t->blocks[index] != NULL && p[0] != (char)index)
+					t->errors++;
+				if (p != NULL)
+					p[0] = (char)index;
+				t->blocks[index] = p;
+				break;
+
+			case SIZED_FREE: /* mm_free_sized */
+				p = t->blocks[index];
+				if (p[0] != (char)index)
+					t->errors++;
+				sized_free(p, size);
+				handoff_drain(&t->inbox);
+				break;
+
+			case FREE: /* mm_free */
+				p = (index < 0) ? NULL : t->blocks[index];
+				if (p != NULL && p[0] != (char)index)
+					t->errors++;
+				if (p != NULL && t->outbox != NULL &&
+						t->outbox->tail - __atomic_load_n(&t->outbox->head,
+							__ATOMIC_ACQUIRE) < HANDOFF_SLOTS) {
+					t->outbox->slots[t->outbox->tail % HANDOFF_SLOTS] = p;
+					__atomic_store_n(&t->outbox->tail, t->outbox->tail + 1,
+							__ATOMIC_RELEASE);
+				}
+				else
+					mm_free(p);
+				handoff_drain(&t->inbox);
+				break;
+
+			default:
+				app_error("Nonexistent request type in eval_mm_thread");
+		}
+	}
+	handoff_drain(&t->inbox);
+	return NULL;
+}
+
+/*
+ * handoff_drain - free the blocks another thread has handed us
+ */
+static void handoff_drain(handoff_t *h)
+{
+	unsigned int tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+
+	while (h->head != tail) {
+		mm_free(h->slots[h->head % HANDOFF_SLOTS]);
+		__atomic_store_n(&h->head, h->head + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * batch_malloc - Allocate n blocks of size bytes into out with one
+ *    mm_malloc_batch call, or with n mm_malloc calls if -S was given.
+ *    Returns the number of blocks allocated.
+ */
+static int batch_malloc(char **out, size_t size, int n)
+{
+	int i;
+
+	if (!split_batches)
+		return mm_malloc_batch(size, n, (void **)out);
+	for (i = 0; i < n && (out[i] = mm_malloc(size)) != NULL; i++)
+		;
+	return i;
+}
+
+/*
+ * batch_free - Free the n blocks in ptrs with one mm_free_batch call,
+ *    or with n mm_free calls if -S was given
+ */
+static void batch_free(char **ptrs, int n)
+{
+	int i;
+
+	if (!split_batches) {
+		mm_free_batch((void **)ptrs, n);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		mm_free(ptrs[i]);
+}
+
+/*
+ * sized_free - Free p, allocated with size bytes, with mm_free_sized,
+ *    or with mm_free if -S was given
+ */
+static void sized_free(void *p, size_t size)
+{
+	if (!split_batches)
+		mm_free_sized(p, size);
+	else
+		mm_free(p);
+}
+
+/*
+ * count_dtlb_misses - Run f(arg) once and return the dTLB load misses
+ *    it caused in user mode, or -1 without running it if the counter is
+ *    not available
+ */
+static long long count_dtlb_misses(void (*f)(void *), void *arg)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+	long long count;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_DTLB |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	if ((fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0)) < 0)
+		return -1;
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	f(arg);
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fd, &count, sizeof(count)) != sizeof(count))
+		count = -1;
+	close(fd);
+	return count;
+#else
+	return -1;
+#endif
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1104,7 +1802,7 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace)
 {
-	int i, newsize;
+	int i, j, newsize;
 	char *p, *newp, *oldp;
 
 	reinit_trace(trace);
@@ -1120,6 +1818,38 @@ static int eval_libc_valid(trace_t *trace)
 				trace->blocks[trace->ops[i].index] = p;
 				break;
 
+			case CACHELINE: /* posix_memalign to a line */
+				if (posix_memalign((void **)&p, CACHE_LINE, trace->ops[i].size) != 0) {
+					malloc_error(trace, i, "libc posix_memalign failed");
+					unix_error("System message");
+				}
+				trace->blocks[trace->ops[i].index] = p;
+				break;
+
+			case MEMALIGN: /* posix_memalign */
+				if (posix_memalign((void **)&p, trace->ops[i].align,
+							trace->ops[i].size) != 0) {
+					malloc_error(trace, i, "libc posix_memalign failed");
+					unix_error("System message");
+				}
+				trace->blocks[trace->ops[i].index] = p;
+				break;
+
+			case BATCH_ALLOC: /* one malloc per block */
+				for (j = 0; j < trace->ops[i].count; j++) {
+					if ((p = malloc(trace->ops[i].size)) == NULL) {
+						malloc_error(trace, i, "libc malloc failed");
+						unix_error("System message");
+					}
+					trace->blocks[trace->ops[i].index + j] = p;
+				}
+				break;
+
+			case BATCH_FREE: /* one free per block */
+				for (j = 0; j < trace->ops[i].count; j++)
+					free(trace->blocks[trace->ops[i].index + j]);
+				break;
+
 			case REALLOC: /* realloc */
 				newsize = trace->ops[i].size;
 				oldp = trace->blocks[trace->ops[i].index];
@@ -1130,6 +1860,10 @@ static int eval_libc_valid(trace_t *trace)
 				trace->blocks[trace->ops[i].index] = newp;
 				break;
 
+			case SIZED_FREE: /* free */
+				free(trace->blocks[trace->ops[i].index]);
+				break;
+
 			case FREE: /* free */
 				if(trace->ops[i].index >= 0) {
 					free(trace->blocks[trace->ops[i].index]);
@@ -1153,7 +1887,7 @@ static int eval_libc_valid(trace_t *trace)
  */
 static void eval_libc_speed(void *ptr)
 {
-	int i;
+	int i, j;
 	int index, size, newsize;
 	char *p, *newp, *oldp, *block;
 	trace_t *trace = ((speed_t *)ptr)->trace;
@@ -1170,6 +1904,37 @@ static void eval_libc_speed(void *ptr)
 				trace->blocks[index] = p;
 				break;
 
+			case CACHELINE: /* posix_memalign to a line */
+				index = trace->ops[i].index;
+				if (posix_memalign((void **)&p, CACHE_LINE, trace->ops[i].size) != 0)
+					unix_error("posix_memalign failed in eval_libc_speed");
+				trace->blocks[index] = p;
+				break;
+
+			case MEMALIGN: /* posix_memalign */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				if (posix_memalign((void **)&p, trace->ops[i].align, size) != 0)
+					unix_error("posix_memalign failed in eval_libc_speed");
+				trace->blocks[index] = p;
+				break;
+
+			case BATCH_ALLOC: /* one malloc per block */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				for (j = 0; j < trace->ops[i].count; j++) {
+					if ((p = malloc(size)) == NULL)
+						unix_error("malloc failed in eval_libc_speed");
+					trace->blocks[index + j] = p;
+				}
+				break;
+
+			case BATCH_FREE: /* one free per block */
+				index = trace->ops[i].index;
+				for (j = 0; j < trace->ops[i].count; j++)
+					free(trace->blocks[index + j]);
+				break;
+
 			case REALLOC: /* realloc */
 				index = trace->ops[i].index;
 				newsize = trace->ops[i].size;
@@ -1180,6 +1945,10 @@ static void eval_libc_speed(void *ptr)
 				trace->blocks[index] = newp;
 				break;
 
+			case SIZED_FREE: /* free */
+				free(trace->blocks[trace->ops[i].index]);
+				break;
+
 			case FREE: /* free */
 				index = trace->ops[i].index;
 				if(index >= 0) {
@@ -1260,6 +2029,99 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printthreadresults - prints the throughput of the concurrent replays
+ */
+static void printthreadresults(int n, stats_t *stats)
+{
+	int i;
+	double ops;
+
+	printf("  %6s%8s%10s%9s  %s\n", "valid", "ops", "secs", "Kops", "trace");
+	for (i=0; i < n; i++) {
+		ops = stats[i].ops * num_threads;
+		if (stats[i].valid && stats[i].mt_secs > 0) {
+			printf("%2s%4s %8.0f%10.6f%9.0f %s\n",
+					stats[i].weight != 0 ? "*" : "",
+					"yes",
+					ops,
+					stats[i].mt_secs,
+					(ops/1e3)/stats[i].mt_secs,
+					stats[i].filename);
+		}
+		else {
+			printf("%2s%4s %8s%10s%9s %s\n",
+					stats[i].weight != 0 ? "*" : "",
+					"no", "-", "-", "-",
+					stats[i].filename);
+		}
+	}
+}
+
+/*
+ * printheapresults - prints the peak, average and final heap size of
+ *    each util run, and how much of the peak had been given back by
+ *    the end.  Fit search probes are given per op and per microsecond
+ *    of the throughput run, and dTLB misses for one throughput run: with
+ *    -H, one on base pages and one on huge pages.
+ */
+static void printheapresults(int n, stats_t *stats)
+{
+	int i;
+
+	printf("  %6s%10s%10s%10s%9s%9s%9s%10s%10s%10s",
+			"valid", "peak KB", "avg KB", "end KB", "trimmed",
+			"extends", "grow KB", "probes/op", "probes/us",
+			huge_pages ? "4K dTLB" : "dTLB miss");
+	if (huge_pages)
+		printf("%10s", "2M dTLB");
+	printf("  %s\n", "trace");
+	for (i=0; i < n; i++) {
+		if (stats[i].valid) {
+			char dtlb[32], base[32];
+
+			format_count(dtlb, stats[i].dtlb_misses);
+			format_count(base, stats[i].dtlb_base);
+			printf("%2s%4s %10.0f%10.0f%10.0f%8.0f%%%9lu%9.0f%10.2f%10.1f%10s",
+					stats[i].weight != 0 ? "*" : "",
+					"yes",
+					stats[i].heap_peak/1024,
+					stats[i].heap_avg/1024,
+					stats[i].heap_end/1024,
+					(stats[i].heap_peak > 0) ?
+					(1 - stats[i].heap_end/stats[i].heap_peak)*100.0 : 0,
+					stats[i].extends,
+					stats[i].extend_size/1024.0,
+					(stats[i].ops > 0) ? stats[i].probes / stats[i].ops : 0,
+					(stats[i].secs > 0) ? stats[i].probes / (stats[i].secs * 1e6) : 0,
+					huge_pages ? base : dtlb);
+			if (huge_pages)
+				printf("%10s", dtlb);
+			printf(" %s\n", stats[i].filename);
+		}
+		else {
+			printf("%2s%4s %10s%10s%10s%9s%9s%9s%10s%10s%10s",
+					stats[i].weight != 0 ? "*" : "",
+					"no", "-", "-", "-", "-", "-", "-", "-", "-", "-");
+			if (huge_pages)
+				printf("%10s", "-");
+			printf(" %s\n", stats[i].filename);
+		}
+	}
+}
+
+/*
+ * format_count - Print a hardware event count into buf, or "n/a" if the
+ *    counter could not be read
+ */
+static void format_count(char *buf, long long count)
+{
+	if (count < 0)
+		strcpy(buf, "n/a");
+	else
+		sprintf(buf, "%lld", count);
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1305,7 +2167,7 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-	fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+	fprintf(stderr, "Usage: mdriver [-hlVCdDHOPSXZ] [-f <file>]\n");
 	fprintf(stderr, "Options\n");
 	fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
 	fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -1316,5 +2178,18 @@ static void usage(void)
 	fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
 	fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
 	fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
+	fprintf(stderr, "\t-T <n>     Also replay each trace in n threads at once.\n");
+	fprintf(stderr, "\t-a <n>     Split the heap into n arenas for the -T replay.\n");
+	fprintf(stderr, "\t-P         Bind threads to arenas by CPU, not round robin.\n");
+	fprintf(stderr, "\t-X         In the -T replay, free each block in the next thread.\n");
+	fprintf(stderr, "\t-M <n>     Map requests above n bytes (0: never).\n");
+	fprintf(stderr, "\t-K <n>     Probe n free blocks past the first fit.\n");
+	fprintf(stderr, "\t-O         Keep free lists in address order.\n");
+	fprintf(stderr, "\t-C         Keep blocks of up to %d bytes within a cache line.\n",
+			CACHE_LINE);
+	fprintf(stderr, "\t-H         Back the heap with 2 MB transparent huge pages,\n");
+	fprintf(stderr, "\t           and count dTLB misses on base pages too.\n");
+	fprintf(stderr, "\t-Z         Keep successor sizes in the free list links.\n");
+	fprintf(stderr, "\t-S         Replay batch and sized requests as plain calls.\n");
 	fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
 }
@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -14,16 +15,54 @@
 #include "memlib.h"
 #include "config.h"
 
+/* the heap starts on a huge page boundary so that it can be backed by
+   transparent huge pages */
+#define HUGE_PAGE (1<<21)
+
 /* private variables */
-static char heap[MAX_HEAP];
-static char *mem_brk = heap; /* points to last byte of heap */
-static char *mem_max_addr = heap + MAX_HEAP;  /* largest legal heap address */ 
+static char *heap;           /* MAX_HEAP bytes of anonymous memory */
+static int huge_pages;       /* advise huge pages for the heap */
+static char *mem_brk;        /* points to last byte of heap */
+static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_hwm;        /* highest brk ever reached; heap above is zero */
+
+/* page-granular regions handed out by mem_map, outside the heap */
+#define MAX_MAPS 1024
+static struct {
+    char *start;
+    size_t size;
+} maps[MAX_MAPS];
+static int nmaps;        /* live regions */
+static size_t map_bytes; /* total bytes in live regions */
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model.  The heap is mapped
+ *    rather than static so that mem_move_pages can remap its pages, and
+ *    aligned to HUGE_PAGE so that mem_set_hugepages can take effect.
  */
 void mem_init(void)
 {
+  char *p;
+  size_t lead;
+
+  if (heap == NULL) {
+    if ((p = mmap(NULL, MAX_HEAP + HUGE_PAGE, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED) {
+      fprintf(stderr, "ERROR: mem_init could not map the heap\n");
+      exit(1);
+    }
+    /* keep the aligned MAX_HEAP bytes and give back the rest */
+    lead = (HUGE_PAGE - (unsigned long)p % HUGE_PAGE) % HUGE_PAGE;
+    if (lead > 0)
+      munmap(p, lead);
+    munmap(p + lead + MAX_HEAP, HUGE_PAGE - lead);
+    heap = p + lead;
+    mem_hwm = heap;                /* fresh pages read as zero */
+    mem_set_hugepages(huge_pages);
+  }
+  /* a heap that is already mapped keeps its high-water mark, since the
+     bytes below it may still hold old data */
+  mem_max_addr = heap + MAX_HEAP;
   mem_brk = heap;                  /* heap is empty initially */
 }
 
@@ -32,21 +71,44 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-  /*    free(mem_start_brk); */
+  munmap(heap, MAX_HEAP);
+  heap = NULL;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_set_hugepages - Ask the system to back the heap with transparent
+ *    huge pages, or to keep it on base pages if enable is 0.  Applies to
+ *    heap pages touched from now on; if the heap is empty its old pages
+ *    are dropped too, so all of it faults back in at the new size.
+ *    Returns 0 on success or -1 if the system does not support the advice.
+ */
+int mem_set_hugepages(int enable)
+{
+    huge_pages = enable;
+    if (heap == NULL)
+	return 0;
+    if (mem_brk == heap && mem_hwm > heap) {
+	madvise(heap, mem_hwm - heap, MADV_DONTNEED);
+	mem_hwm = heap;            /* dropped pages read as zero */
+    }
+    return madvise(heap, MAX_HEAP, enable ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and unmap every region mem_map handed out
  */
 void mem_reset_brk()
 {
     mem_brk = heap;
+    while (nmaps > 0)
+	mem_unmap(maps[0].start, maps[0].size);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
  *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    this model, the heap cannot be shrunk; see mem_shrink.
  */
 void *mem_sbrk(int incr) 
 {
@@ -58,6 +120,26 @@ void *mem_sbrk(int incr)
 	return (void *)-1;
     }
     mem_brk += incr;
+    if (mem_brk > mem_hwm)
+	mem_hwm = mem_brk;
+    return (void *)old_brk;
+}
+
+/*
+ * mem_shrink - give the top decr bytes of the heap back, lowering the
+ *    break, and return the old break.  The heap cannot shrink below
+ *    its start.
+ */
+void *mem_shrink(size_t decr)
+{
+    char *old_brk = mem_brk;
+
+    if (decr > (size_t)(mem_brk - heap)) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_shrink below the start of the heap\n");
+	return (void *)-1;
+    }
+    mem_brk -= decr;
     return (void *)old_brk;
 }
 
@@ -77,6 +159,16 @@ void *mem_heap_hi()
     return (void *)(mem_brk - 1);
 }
 
+/*
+ * mem_heap_hwm - return the first heap byte that mem_sbrk has never
+ *    handed out.  Like fresh pages from a real sbrk, every byte from
+ *    there to the end of the heap is still zero.
+ */
+void *mem_heap_hwm()
+{
+    return (void *)mem_hwm;
+}
+
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
@@ -92,3 +184,138 @@ size_t mem_pagesize()
 {
     return (size_t)getpagesize();
 }
+
+/*
+ * mem_map - model of an anonymous mmap.  Returns a new page-aligned
+ *    region of size bytes, rounded up to whole pages, that lies outside
+ *    the heap and reads as zero, or NULL if none is left.
+ */
+void *mem_map(size_t size)
+{
+    size_t page = mem_pagesize();
+    char *p;
+
+    size = (size + page - 1) & ~(page - 1);
+    if (nmaps == MAX_MAPS ||
+	(p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+	errno = ENOMEM;
+	fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+	return NULL;
+    }
+    maps[nmaps].start = p;
+    maps[nmaps].size = size;
+    nmaps++;
+    map_bytes += size;
+    return (void *)p;
+}
+
+/*
+ * mem_unmap - model of munmap.  Hands the region at ptr, which mem_map
+ *    returned for size bytes, back to the system.  Returns 0 on success
+ *    or -1 if ptr is not a live region.
+ */
+int mem_unmap(void *ptr, size_t size)
+{
+    size_t page = mem_pagesize();
+    int i;
+
+    size = (size + page - 1) & ~(page - 1);
+    for (i = 0; i < nmaps; i++)
+	if (maps[i].start == ptr && maps[i].size == size)
+	    break;
+    if (i == nmaps) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_unmap of %p is not a mapped region\n", ptr);
+	return -1;
+    }
+    munmap(ptr, size);
+    maps[i] = maps[--nmaps];
+    map_bytes -= size;
+    return 0;
+}
+
+/*
+ * mem_remap - model of mremap with MREMAP_MAYMOVE.  Resizes the region
+ *    at ptr, which mem_map returned for oldsize bytes, to newsize bytes
+ *    and returns its possibly new address, or NULL if it cannot.  Pages
+ *    are moved, not copied, and any new ones read as zero.
+ */
+void *mem_remap(void *ptr, size_t oldsize, size_t newsize)
+{
+    size_t page = mem_pagesize();
+    char *p;
+    int i;
+
+    oldsize = (oldsize + page - 1) & ~(page - 1);
+    newsize = (newsize + page - 1) & ~(page - 1);
+    for (i = 0; i < nmaps; i++)
+	if (maps[i].start == ptr && maps[i].size == oldsize)
+	    break;
+    if (i == nmaps) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_remap of %p is not a mapped region\n", ptr);
+	return NULL;
+    }
+    if ((p = mremap(ptr, oldsize, newsize, MREMAP_MAYMOVE)) == MAP_FAILED) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    maps[i].start = p;
+    maps[i].size = newsize;
+    map_bytes += newsize - oldsize;
+    return (void *)p;
+}
+
+/*
+ * mem_move_pages - Move the size bytes of heap pages at src to dst
+ *    without copying them; both must be page aligned and must not
+ *    overlap.  src reads as zero afterwards.  Returns 0 on success or
+ *    -1, leaving both ranges as they were, if the pages cannot be moved.
+ */
+int mem_move_pages(void *dst, void *src, size_t size)
+{
+    size_t page = mem_pagesize();
+
+    if (((unsigned long)dst | (unsigned long)src | size) & (page - 1) ||
+	(char *)src < heap || (char *)src + size > mem_brk ||
+	(char *)dst < heap || (char *)dst + size > mem_brk ||
+	((char *)dst < (char *)src + size && (char *)src < (char *)dst + size)) {
+	errno = EINVAL;
+	return -1;
+    }
+    if (size == 0)
+	return 0;
+    if (mremap(src, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, dst) == MAP_FAILED)
+	return -1;
+    if (mmap(src, size, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_move_pages lost the heap at %p\n", src);
+	exit(1);
+    }
+    madvise(src, size, huge_pages ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+    return 0;
+}
+
+/*
+ * mem_mapsize - returns the total size in bytes of all mapped regions
+ */
+size_t mem_mapsize()
+{
+    return map_bytes;
+}
+
+/*
+ * mem_mapped - returns 1 if the bytes lo through hi lie within a
+ *    single mapped region
+ */
+int mem_mapped(void *lo, void *hi)
+{
+    int i;
+
+    for (i = 0; i < nmaps; i++)
+	if ((char *)lo >= maps[i].start &&
+	    (char *)hi < maps[i].start + maps[i].size)
+	    return 1;
+    return 0;
+}
@@ -3,9 +3,18 @@
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+void *mem_shrink(size_t decr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_heap_hwm(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+int mem_set_hugepages(int enable);
+void *mem_map(size_t size);
+int mem_unmap(void *ptr, size_t size);
+void *mem_remap(void *ptr, size_t oldsize, size_t newsize);
+int mem_move_pages(void *dst, void *src, size_t size);
+size_t mem_mapsize(void);
+int mem_mapped(void *lo, void *hi);
 
@@ -1,45 +1,262 @@
 /* 
- * mm.c -  explicit free list allocator with first fit replacement
+ * mm.c -  explicit free list allocator with two-level segregated fit.
+ *
+ * Free blocks are kept on doubly linked class lists indexed TLSF style:
+ * the first level splits sizes by power of two, the second level splits
+ * each power of two into SL_COUNT equal ranges.  fl_bitmap records
+ * which first-level rows have a non-empty list and sl_bitmap[fl] which
+ * lists of that row are non-empty, so find_fit() is a constant number
+ * of find-first-set operations plus a list pop regardless of heap size.
+ * mm_set_addr_order(1) keeps each list in address order instead of LIFO.
+ * An address index records, for every class and ARENA_PAGE, whether
+ * the page holds a listed block of that class and which is the lowest.
+ * An insertion finds its place from the lowest block of its own page or
+ * of the next page up, found with a bitmap scan, so it walks at most
+ * the blocks of one page rather than the list.
+ *
+ * Past the first fit, find_fit() probes up to fit_probes more blocks of
+ * the same list (mm_set_fit_probes) and keeps the tightest, which buys
+ * some of best fit's utilization for a fixed amount of extra work.
+ * The list links are 32-bit offsets from the start of the heap, which
+ * MAX_HEAP keeps well in range, so a free block needs only 16 bytes.
+ * A list walk prefetches the next block while it looks at the current
+ * one.  With mm_set_packed_sizes(1) the successor link of every listed
+ * block also carries the successor's size in the bits MAX_HEAP leaves
+ * spare, so a probe reads only the 8-byte aligned link pair of one
+ * block, which never crosses a cache line, and no header at all.
+ *
+ * Free blocks of TREE_MIN bytes or more are kept out of the lists and
+ * in a red-black tree ordered by (size, address) whose nodes live in
+ * the free block payloads.  Large requests take the smallest block that
+ * fits from the tree, i.e. true best fit in O(log n).
+ *
+ * Only free blocks carry a footer.  Bit 1 of every header records
+ * whether the previous block is allocated, which is all coalesce()
+ * needs to know before it reads the previous block's footer.
+ *
+ * Bit 2 marks a block whose payload is known to be zero from offset
+ * ZERO_AT(bp) up to its footer, because that memory came from mem_sbrk
+ * above its high-water mark and has not been written since.  The
+ * offset is kept past the list links and tree node, which may dirty the
+ * first ZERO_SKIP bytes of any free block.  place() and coalesce()
+ * carry the offset over, and mm_calloc() only clears the bytes below it.
+ *
+ * Requests of SLAB_MAX bytes or less never reach the block heap.  They
+ * are served from slabs: SLAB_SIZE-aligned runs carved out of the heap
+ * as ordinary allocated blocks, each holding equally sized slots for
+ * one size class.  Slots have no header; the slab header at the start
+ * of the run records the slot size and a bitmap of free slots, and
+ * slab_map marks which SLAB_SIZE pages of the heap are slabs so that
+ * mm_free() can route a pointer with a single bit test.
+ * mm_set_cacheline_slabs(1) rounds slots up to a power of two and
+ * starts them on a CACHE_LINE boundary, so no slot straddles a line.
+ * mm_malloc_cacheline() gives an object whole lines of its own.
+ *
+ * Freed blocks smaller than QL_MAX are not coalesced right away.  They
+ * stay marked allocated on per-size LIFO quick lists, where a malloc of
+ * exactly that size finds them first.  mm_free_sized() files a block by
+ * the size it was asked for, which can be up to 2*DSIZE short of the
+ * block's own.  A quick list is coalesced into the heap when it grows
+ * past QL_LIMIT blocks, and all of them are when a request finds no fit.
+ *
+ * Requests larger than mmap_threshold bytes (MMAP_THRESHOLD unless set
+ * with mm_set_mmap_threshold) bypass the arenas.  Each gets a region of
+ * its own from mem_map with its header DSIZE bytes into the first page,
+ * and mm_free() hands the region straight back with mem_unmap.  Such
+ * blocks never sit in the heap, so IS_MAPPED tells them apart by
+ * address alone.  The word before the header holds MAP_LEAD, the
+ * distance from the start of the region to the payload, which is more
+ * than DSIZE when the payload had to be aligned.
+ *
+ * mm_memalign() and friends serve aligned requests from the block heap
+ * through place_aligned(), which puts the slack in front of the aligned
+ * payload back on the free lists.  Slab slots are never aligned past
+ * ALIGNMENT, so aligned requests bypass the slabs.  The result is an
+ * ordinary block, which mm_free() and mm_realloc() take as it is.
+ *
+ * When no fit is found the heap grows by the arena's current extension
+ * size rather than a fixed CHUNKSIZE.  It doubles, up to GROW_MAX and
+ * to a GROW_FRAC share of the heap, when the heap had to grow again
+ * within GROW_BURST allocations, and halves back towards GROW_MIN when
+ * extensions are further apart.
+ *
+ * A free block of TRIM_THRESHOLD bytes or more at the top of the heap
+ * is cut back to TRIM_PAD bytes and the rest handed back to memlib with
+ * mem_shrink; mm_trim() does the same on demand.
+ *
+ * mm_malloc_batch() carves up to BATCH_SPAN bytes' worth of equally
+ * sized blocks out of a single fit, laying down their headers in one
+ * pass.  mm_free_batch() sorts its blocks by address and frees each run
+ * of neighbours as one block, so a run costs a single coalesce.
+ *
+ * mm_set_threaded(1) makes the package thread safe.  Each thread then
+ * keeps a cache of recently freed blocks per TC_STEP size bin that
+ * serves malloc and free without touching shared state; caches are
+ * refilled from and flushed to the heap TC_BATCH blocks at a time.
+ *
+ * The heap itself is split into arenas (mm_set_arenas), each with its
+ * own lock, lists, tree and slabs.  An arena owns one or more heap
+ * segments, each fenced by its own prologue and epilogue and extended
+ * in place while it is the last thing in the heap.  New segments start
+ * on an ARENA_PAGE boundary and arena_map records the owner of every
+ * page, so a block is always freed back to the arena it came from.
+ * Threads are bound to arenas round robin, or pick the arena of the
+ * CPU they are running on.
+ *
+ * A thread never takes another arena's lock to free a block.  Blocks
+ * owned by a foreign arena are pushed onto that arena's remote stack
+ * with a single compare-and-swap, and whichever thread next holds the
+ * arena lock takes the whole stack with one exchange and frees it.
+ * That includes the owner's own frees and reallocs, so a thread that
+ * has stopped allocating still returns what others freed for it.
  */
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 
 /* $begin mallocmacros */
 /* Basic constants and macros */  
 #define WSIZE       4       /* word size (bytes) */  
 #define DSIZE       8       /* doubleword size (bytes) */
 #define CHUNKSIZE  (1<<12)  /* initial heap size (bytes) */
-#define MINIMUM     24      /* minimum block size, to include space for
-                               linked list pointers (bytes)  */
+#define MINIMUM     16      /* minimum block size, to include space for
+                               linked list offsets (bytes)  */
+
+/* Two-level segregated fit parameters */
+#define SL_LOG      3                   /* log2 of lists per power of two */
+#define SL_COUNT    (1 << SL_LOG)       /* second-level lists per row */
+#define FL_SHIFT    (SL_LOG + 3)        /* sizes below 1<<FL_SHIFT are row 0 */
+#define FL_COUNT    (32 - FL_SHIFT + 1) /* rows for any 32-bit block size */
+#define NUM_CLASSES (FL_COUNT * SL_COUNT)
+
+#define FIT_PROBES  8       /* default blocks probed past the first fit */
+
+#define TREE_LOG    10
+#define TREE_MIN    (1<<TREE_LOG) /* free blocks this large go in the tree */
+#define LIST_CLASSES ((TREE_LOG - FL_SHIFT + 1) * SL_COUNT) /* classes below it */
+
+/* Slab layer parameters */
+#define SLAB_SIZE    (1<<9)   /* bytes per slab, also its alignment */
+#define SLAB_STEP    8        /* slot size granularity */
+#define SLAB_MAX     64       /* largest request served from slabs */
+#define SLAB_CLASSES (SLAB_MAX / SLAB_STEP)
+#define SLAB_WORDS   ((SLAB_SIZE / SLAB_STEP + 63) / 64)
+#define CACHE_LINE   64       /* bytes per cache line */
+
+/* Quick list parameters */
+#define QL_MAX       TREE_MIN  /* blocks smaller than this are quick listed */
+#define QL_LISTS     (QL_MAX / DSIZE) /* one list per block size */
+#define QL_LIMIT     32        /* blocks a list may hold before it is coalesced */
+
+/* Adaptive heap extension parameters */
+#define GROW_MIN       CHUNKSIZE      /* smallest extension */
+#define GROW_MAX       (16*CHUNKSIZE) /* largest extension */
+#define GROW_FRAC      16  /* no extension exceeds 1/GROW_FRAC of the heap */
+#define GROW_BURST     32  /* allocations between extensions in a burst */
+
+/* Batch allocation parameters */
+#define BATCH_SPAN     GROW_MAX /* most bytes carved from a single fit */
+
+/* Heap trimming parameters */
+#define TRIM_THRESHOLD (1<<17) /* free top block size that triggers a trim */
+#define TRIM_PAD       CHUNKSIZE /* bytes an automatic trim leaves free */
+
+/* Mapped block parameters */
+#define MMAP_THRESHOLD (1<<16) /* default size above which requests are mapped */
+
+/* Blocks whose payloads are moved by remapping pages */
+#define REMAP_MIN      (1<<18) /* smallest payload moved a page at a time,
+                                  about where it starts to beat memcpy */
+
+/* Thread cache parameters */
+#define TC_STEP      16       /* bin size granularity */
+#define TC_MAX       256      /* largest request served from a thread cache */
+#define TC_BINS      (TC_MAX / TC_STEP)
+#define TC_LIMIT     32       /* blocks a bin may hold before it is flushed */
+#define TC_BATCH     16       /* blocks moved per refill or flush */
+
+/* Arena parameters */
+#define MAX_ARENAS   64
+#define ARENA_PAGE   (8*SLAB_SIZE) /* ownership granularity: one slab_map byte */
+#define REMOTE_LIMIT 64       /* remote frees that force a drain on malloc */
+
+/* Address index of the sorted lists, one entry per ARENA_PAGE */
+#define INDEX_PAGES  (MAX_HEAP / ARENA_PAGE + 1)
+#define INDEX_WORDS  ((INDEX_PAGES + 63) / 64)
 
 #define MAX(x, y) ((x) > (y)? (x) : (y))  
+#define MIN(x, y) ((x) < (y)? (x) : (y))
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc)  ((size) | (alloc))
+#define PREV_ALLOC  0x2     /* header bit: previous block is allocated */
+#define KNOWN_ZERO  0x4     /* header bit: payload is zero from ZERO_AT(bp) */
+#define ZERO_SKIP   (4*DSIZE) /* payload bytes free block links may dirty */
 
 /* Read and write a word at address p */
 #define GET(p)       (*(unsigned int *)(p)) 
 #define PUT(p, val)  (*(unsigned int *)(p) = (val))  
 
-/* Read and write an address at p */
-#define SUCC(bp)   (*(void **)(bp+DSIZE))
-#define PRED(bp)   (*(void **)(bp))
+/* Convert between a heap address and its 32-bit offset from heap_base;
+   offset 0 is never a block, so it stands for NULL */
+#define TO_OFF(p)    ((p) ? (unsigned int)((unsigned long)(p) - heap_base) : 0)
+#define FROM_OFF(o)  ((o) ? (void *)(heap_base + (o)) : NULL)
+
+/* Hint that the block at bp and its header will be read soon */
+#define PREFETCH(bp) __builtin_prefetch(bp)
+
+/* Read and write the free list links of bp, stored as offsets.  The
+   successor link keeps the offset in its low LINK_BITS, and with packed
+   sizes the successor's size over ALIGNMENT above them; listed blocks
+   are smaller than TREE_MIN, so that fits. */
+#define LINK_BITS  25                   /* offsets below MAX_HEAP */
+#define LINK(bp)   (*(unsigned int *)((void *)(bp)+WSIZE)) /* whole link */
+#define SUCC(bp)   FROM_OFF(LINK(bp) & ((1U << LINK_BITS) - 1))
+#define SUCC_SIZE(bp) ((LINK(bp) >> LINK_BITS) * ALIGNMENT)
+#define PRED(bp)   FROM_OFF(GET(bp))
+#define SET_SUCC(bp, p) (LINK(bp) = TO_OFF(p) | \
+  (packed_sizes && (p) ? GET_SIZE(HDRP(p)) / ALIGNMENT << LINK_BITS : 0))
+#define SET_PRED(bp, p) PUT(bp, TO_OFF(p))
+
+/* Read and write the tree node fields of a large free block at bp */
+#define LEFT(bp)   (*(void **)(bp))
+#define RIGHT(bp)  (*(void **)((void *)(bp)+DSIZE))
+#define PARENT(bp) (*(void **)((void *)(bp)+2*DSIZE))
+#define COLOR(bp)  (*(unsigned int *)((void *)(bp)+3*DSIZE))
+#define RED        1
+#define BLACK      0
+#define IS_RED(bp) ((bp) != NULL && COLOR(bp) == RED)
+
+/* Payload offset from which a KNOWN_ZERO block at bp is zero.  It sits
+   just past the tree node, in bytes no free block link ever uses. */
+#define ZERO_AT(bp) (*(unsigned int *)((void *)(bp)+ZERO_SKIP-WSIZE))
 
 /* Read the size and allocated fields from address p */
 #define GET_SIZE(p)  (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+
+/* Set or clear the previous-block-allocated bit of the header at p */
+#define SET_PREV_ALLOC(p) PUT(p, GET(p) | PREV_ALLOC)
+#define CLR_PREV_ALLOC(p) PUT(p, GET(p) & ~PREV_ALLOC)
 
 /* Given block ptr bp, compute address of its header and footer */
 #define HDRP(bp)       ((void *)(bp) - WSIZE)  
 #define FTRP(bp)       ((void *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
-/* Given block ptr bp, compute address of next and previous blocks */
+/* Given block ptr bp, compute address of next and previous blocks.
+   PREV_BLKP reads the previous footer, so it is only valid when the
+   previous block is free. */
 #define NEXT_BLKP(bp)  ((void *)(bp) + GET_SIZE(((bp) - WSIZE)))
 #define PREV_BLKP(bp)  ((void *)(bp) - GET_SIZE(((bp) - DSIZE)))
 
@@ -50,21 +267,187 @@
 /* rounds up to the nearest multiple of ALIGNMENT */
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
 
+/* block size for a payload of size bytes: header only, no footer */
+#define ASIZE(size) MAX(ALIGN((size) + WSIZE), MINIMUM)
+
+/* Given a slot pointer p, compute its slab and the slab_map position */
+#define SLAB_OF(p)    ((slab_t *)((unsigned long)(p) & ~(unsigned long)(SLAB_SIZE-1)))
+#define SLAB_PAGE(p)  (((unsigned long)(p) - page_base) / SLAB_SIZE)
+#define IS_SLAB(p)    ((slab_map[SLAB_PAGE(p) / 8] >> (SLAB_PAGE(p) % 8)) & 1)
+
+/* First slot of slab s */
+#define SLAB_SLOTS(s) ((char *)(s) + slab_start)
+
+/* Link of a block sitting in a thread cache bin */
+#define TC_NEXT(bp)   (*(void **)(bp))
+
+/* Link of a block sitting on a quick list */
+#define QL_NEXT(bp)   (*(void **)(bp))
+
+/* Is p outside the heap, i.e. in a mapped block? */
+#define IS_MAPPED(p)  ((unsigned long)(p) - heap_base >= MAX_HEAP)
+
+/* Bytes from the start of the region of mapped block bp to bp */
+#define MAP_LEAD(bp)  GET((void *)(bp) - DSIZE)
+
+/* Arena owning the heap address p */
+#define ARENA_PAGE_OF(p) (((unsigned long)(p) - page_base) / ARENA_PAGE)
+#define ARENA_OF(p)   (&arenas[arena_map[ARENA_PAGE_OF(p)]])
+
+/* Is there a block of list class on page in a's address index, and
+   which is the lowest there? */
+#define INDEX_HAS(a, class, page) \
+  (((a)->index_map[class][(page) / 64] >> ((page) % 64)) & 1)
+#define INDEX_LOW(class, page) \
+  ((void *)(page_base + (page) * ARENA_PAGE + index_low[page][class] * ALIGNMENT))
+
+/* Take and release an arena lock, or the sbrk lock, in thread-safe mode */
+#define LOCK(a)   do { if (threaded) pthread_mutex_lock(&(a)->lock); } while (0)
+#define UNLOCK(a) do { if (threaded) pthread_mutex_unlock(&(a)->lock); } while (0)
+#define SBRK_LOCK()   do { if (threaded) pthread_mutex_lock(&sbrk_lock); } while (0)
+#define SBRK_UNLOCK() do { if (threaded) pthread_mutex_unlock(&sbrk_lock); } while (0)
+
 /* $end mallocmacros */
 
+/* Header at the start of every slab */
+typedef struct slab {
+  struct slab *next;      /* next slab of this class with free slots */
+  struct slab *prev;      /* previous slab of this class with free slots */
+  unsigned int size;      /* slot size (bytes) */
+  unsigned short nslots;  /* number of slots */
+  unsigned short nfree;   /* number of free slots */
+  unsigned long bitmap[SLAB_WORDS]; /* set bits mark free slots */
+} slab_t;
+
+/* An independent heap: its free lists, tree and slabs */
+typedef struct arena {
+  pthread_mutex_t lock;                 /* guards everything below */
+  void *seg_lists[NUM_CLASSES];         /* heads of the segregated free lists */
+  unsigned int fl_bitmap;               /* rows with a non-empty list */
+  unsigned int sl_bitmap[FL_COUNT];     /* non-empty lists within a row */
+  void *tree_root;                      /* tree of large free blocks */
+  slab_t *slab_lists[SLAB_CLASSES];     /* slabs with free slots, per class */
+  void *quick[QL_LISTS];                /* uncoalesced freed blocks, by size */
+  int nquick[QL_LISTS];                 /* blocks on each quick list */
+  char *epilogue;         /* epilogue header of the newest segment, or NULL */
+  void *remote;           /* blocks freed by other threads, lock free */
+  int nremote;            /* blocks on the remote stack */
+  size_t grow;            /* bytes the next extension asks for */
+  unsigned long nmalloc;  /* block heap allocations so far */
+  unsigned long last_grow; /* nmalloc at the last extension */
+  unsigned long nextend;  /* extensions so far */
+  unsigned long nprobe;   /* free blocks looked at by fit searches */
+  unsigned long index_map[LIST_CLASSES][INDEX_WORDS]; /* pages with listed
+                             blocks, per class, in address order mode */
+  unsigned long index_top; /* no index_map bits at or past this page */
+} arena_t;
+
+/* Per-thread cache of free blocks */
+typedef struct {
+  void *bins[TC_BINS];    /* blocks able to hold (bin+1)*TC_STEP bytes */
+  int counts[TC_BINS];    /* number of blocks in each bin */
+  unsigned int gen;       /* heap_gen the cached blocks belong to */
+  arena_t *arena;         /* arena the thread allocates from */
+} tcache_t;
+
 /* Global variables */
 static char *heap_listp = 0;  /* pointer to first block in heap list */  
-static char *free_listp = 0;  /* pointer to first block address in free list */
+static unsigned long heap_base;         /* first heap byte, for IS_MAPPED */
+static unsigned long page_base;         /* ARENA_PAGE-aligned heap start */
+static size_t mmap_threshold = MMAP_THRESHOLD; /* 0: never map */
+static int fit_probes = FIT_PROBES;     /* probe budget of this heap */
+static int fit_probes_next = FIT_PROBES; /* set by mm_set_fit_probes() */
+static int addr_order;                  /* address-ordered lists of this heap */
+static int addr_order_next;             /* set by mm_set_addr_order() */
+static int packed_sizes;                /* links carry SUCC_SIZE */
+static int packed_sizes_next;           /* set by mm_set_packed_sizes() */
+static int line_slabs;                  /* slots never straddle a line */
+static int line_slabs_next;             /* set by mm_set_cacheline_slabs() */
+static size_t slab_start;               /* offset of the first slot */
+static unsigned char slab_map[MAX_HEAP / SLAB_SIZE / 8 + 1]; /* slab pages */
+
+/* Arenas */
+static arena_t arenas[MAX_ARENAS];
+static int narenas = 1;                 /* set by mm_set_arenas() */
+static int arena_by_cpu;                /* pick arenas by CPU, not per thread */
+static unsigned int arena_next;         /* round-robin binding counter */
+static unsigned char arena_map[MAX_HEAP / ARENA_PAGE + 1]; /* page owners */
+static unsigned short index_low[INDEX_PAGES][LIST_CLASSES]; /* lowest listed
+                                          block per page and class, valid
+                                          where the owner's index_map says */
+
+/* Thread-safe mode */
+static int threaded;                    /* set by mm_set_threaded() */
+static unsigned int heap_gen;           /* bumped by every mm_init() */
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;        /* flushes a cache at thread exit */
+static __thread tcache_t tcache;
 
 /* function prototypes for internal helper routines */
-static void *extend_heap(size_t words);
-static void place(void *bp, size_t asize);
-static void *find_fit(size_t asize);
-static void *coalesce(void *bp);
+static void *extend_heap(arena_t *a, size_t words);
+static size_t grow_size(arena_t *a, size_t asize);
+static void *new_segment(arena_t *a);
+static void arena_claim(arena_t *a, void *lo, size_t size);
+static arena_t *arena_get(void);
+static void arena_reset(arena_t *a);
+static void arena_lock_init(void);
+static void place(arena_t *a, void *bp, size_t asize);
+static void *find_fit(arena_t *a, size_t asize);
+static void *good_fit(arena_t *a, void *bp, size_t asize, int probes);
+static void *coalesce(arena_t *a, void *bp);
+static size_t zero_from(void *bp);
+static void set_zero(void *bp, size_t off);
+static size_t zero_merge(void *lo, size_t zlo, void *hi, size_t zhi);
 static void printblock(void *bp); 
 static void checkblock(void *bp);
-static void fcons(void *bp);
-static void fremove(void *bp);
+static int checklists(arena_t *a);
+static int checktree(arena_t *a, void *bp, void *lo, void *hi, int *count);
+static int fls_size(size_t size);
+static int size_class(size_t size);
+static void fcons(arena_t *a, void *bp);
+static void fremove(arena_t *a, void *bp);
+static void *index_pred(arena_t *a, int class, void *bp);
+static long index_above(arena_t *a, int class, unsigned long page);
+static long index_below(arena_t *a, int class, unsigned long page);
+static int tree_less(void *a, void *b);
+static void tree_rotate_left(arena_t *a, void *x);
+static void tree_rotate_right(arena_t *a, void *x);
+static void tree_transplant(arena_t *a, void *u, void *v);
+static void tree_insert(arena_t *a, void *z);
+static void tree_remove(arena_t *a, void *z);
+static void *tree_best_fit(arena_t *a, size_t asize);
+static void *place_aligned(arena_t *a, size_t align, size_t off, size_t asize);
+static int slab_class(size_t size);
+static void *slab_alloc(arena_t *a, size_t size);
+static void slab_free(arena_t *a, void *p);
+static void slab_release(arena_t *a);
+static int checkslabs(arena_t *a);
+static void checkquick(arena_t *a);
+static void *heap_malloc(arena_t *a, size_t size);
+static void heap_free(arena_t *a, void *bp);
+static void quick_put(arena_t *a, void *bp, size_t size);
+static void free_block(arena_t *a, void *bp);
+static int carve(arena_t *a, size_t asize, int n, void **out);
+static void free_run(arena_t *a, void **ptrs, int n);
+static int addr_cmp(const void *x, const void *y);
+static int trim(arena_t *a, size_t pad);
+static int quick_flush(arena_t *a, int list);
+static void *fit_or_flush(arena_t *a, size_t asize);
+static void *heap_realloc(arena_t *a, void *ptr, size_t size);
+static void *map_alloc(size_t align, size_t size);
+static void map_free(void *bp);
+static void *map_realloc(void *ptr, size_t size);
+static void *grow_in_place(arena_t *a, void *bp, size_t asize);
+static void move_payload(void *dst, void *src, size_t n);
+static size_t usable_size(void *bp);
+static tcache_t *tcache_get(void);
+static void tcache_flush(tcache_t *tc, int bin, int n);
+static void tcache_exit(void *arg);
+static void tcache_key_init(void);
+static void remote_push(arena_t *a, void *bp);
+static void remote_drain(arena_t *a);
 
 /* 
  * mm_init - Initialize the memory manager
@@ -75,346 +458,2324 @@ static void fremove(void *bp);
 int mm_init(void) 
 {
   //printf("mm_init\n");
-  /* create the initial empty heap */
-  if ((heap_listp = mem_sbrk(2*MINIMUM)) == NULL)
+  int i;
+
+  pthread_once(&arena_once, arena_lock_init);
+  heap_gen++; /* blocks in thread caches belong to the old heap */
+
+  for (i = 0; i < MAX_ARENAS; i++)
+    arena_reset(&arenas[i]);
+  arena_next = 0;
+  fit_probes = fit_probes_next;
+  addr_order = addr_order_next;
+  packed_sizes = packed_sizes_next;
+  line_slabs = line_slabs_next;
+  slab_start = line_slabs ? CACHE_LINE : ALIGN(sizeof(slab_t));
+  memset(slab_map, 0, sizeof(slab_map));
+  memset(arena_map, 0, sizeof(arena_map));
+  heap_base = (unsigned long)mem_heap_lo();
+  page_base = heap_base & ~(unsigned long)(ARENA_PAGE-1);
+
+  /* create the initial empty heap as the first segment of arena 0 */
+  if ((heap_listp = new_segment(&arenas[0])) == NULL)
     return -1;
 
-  PUT(heap_listp, 0);                          /* alignment padding */
-  PUT(heap_listp + WSIZE, PACK(MINIMUM, 1));   /* prologue header */ 
-  PUT(heap_listp + DSIZE, 0);                  /* pred pointer */
-  PUT(heap_listp + DSIZE+WSIZE, 0);            /* succ pointer */
-  PUT(heap_listp + MINIMUM, PACK(MINIMUM, 1)); /* prologue footer */ 
-  PUT(heap_listp + MINIMUM+WSIZE, PACK(0, 1)); /* epilogue header */
-
-  free_listp = heap_listp + DSIZE;   /* adjust free_listp to be the succ pointer of the prologue header */
   /* Extend the empty heap with a free block of CHUNKSIZE bytes */
-  if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
+  if (extend_heap(&arenas[0], CHUNKSIZE/WSIZE) == NULL)
     return -1;
-
   return 0;
 }
 /* $end mm_init */
 
 /*
- * malloc - Allocate a block with at least size bytes of payload 
+ * mm_set_threaded - Turn thread-safe mode on or off.  Must be called
+ *    while no other thread is using the package, before mm_init.
  */
-/* $begin mmmalloc */
-void *mm_malloc(size_t size)
+void mm_set_threaded(int enable)
 {
-  //printf("mm_malloc\n");
-  size_t asize;      /* adjusted block size */
-  size_t extendsize; /* amount to extend heap if no fit */
-  char *bp;    
-
-  /* Ignore spurious requests */
-  if (size <= 0)
-    return NULL;
-
-  /* Adjust block size to include overhead and alignment reqs. */
-  asize = MAX(ALIGN(size) + DSIZE, MINIMUM);
+  threaded = enable;
+}
 
-  /* Search the free list for a fit */
-  if ((bp = find_fit(asize))) {
-    place(bp, asize);
-    return bp;
+/*
+ * mm_trim - Coalesce all deferred frees and empty slabs, then give the
+ *    free top of the heap back to memlib, keeping pad bytes of it
+ */
+int mm_trim(size_t pad)
+{
+  int i, ret = 0;
+
+  for (i = 0; i < narenas; i++) {
+    LOCK(&arenas[i]);
+    remote_drain(&arenas[i]);
+    quick_flush(&arenas[i], -1);
+    slab_release(&arenas[i]);
+    ret |= trim(&arenas[i], pad);
+    UNLOCK(&arenas[i]);
   }
+  return ret;
+}
 
-  /* No fit found. Get more memory and place the block */
-  extendsize = MAX(asize, CHUNKSIZE);
-  if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
-    return NULL;
-  place(bp, asize);
-  return bp;
-} 
-/* $end mmmalloc */
+/*
+ * mm_set_mmap_threshold - Map requests larger than size bytes rather
+ *    than carving them from the heap; 0 turns mapping off
+ */
+void mm_set_mmap_threshold(size_t size)
+{
+  mmap_threshold = size;
+}
 
-/* 
- * mm_free - Free a block 
+/*
+ * mm_set_fit_probes - Probe up to k more blocks of a free list past the
+ *    first fit, keeping the tightest; 0 takes the first fit.  Takes
+ *    effect at the next mm_init.
  */
-/* $begin mmfree */
-void mm_free(void *bp)
+void mm_set_fit_probes(int k)
 {
-  //printf("mm_free\n");
-  if(bp == 0) return;   /* Ignore free(NULL) */
-  
-  size_t size = GET_SIZE(HDRP(bp));
+  fit_probes_next = k < 0 ? 0 : k;
+}
 
-  PUT(HDRP(bp), PACK(size, 0));
-  PUT(FTRP(bp), PACK(size, 0));
-  coalesce(bp);
+/*
+ * mm_set_addr_order - Keep the free lists in address order rather than
+ *    LIFO.  Takes effect at the next mm_init.
+ */
+void mm_set_addr_order(int enable)
+{
+  addr_order_next = enable;
 }
-/* $end mmfree */
 
 /*
- * mm_realloc - naive implementation of realloc
+ * mm_set_packed_sizes - Keep the size of each listed block's successor
+ *    in its link, for fit searches to read.  Takes effect at the next
+ *    mm_init.
  */
-void *mm_realloc(void *ptr, size_t size)
+void mm_set_packed_sizes(int enable)
 {
-  //printf("mm_realloc\n");
-  size_t oldsize;
-  size_t asize;
-  void *newptr;
+  packed_sizes_next = enable;
+}
 
-  /* If size == 0 then this is just free, and we return NULL. */
-  if(size <= 0) {
-    mm_free(ptr);
-    return 0;
-  }
+/*
+ * mm_set_cacheline_slabs - Lay slabs out so that no slot straddles a
+ *    cache line.  Takes effect at the next mm_init.
+ */
+void mm_set_cacheline_slabs(int enable)
+{
+  line_slabs_next = enable;
+}
 
-  /* If oldptr is NULL, then this is just malloc. */
-  if(ptr == NULL) {
-    return mm_malloc(size);
+/*
+ * mm_get_stats - Fill in st with heap growth and fit search statistics
+ *    summed over all arenas; extend_size is the largest current
+ *    extension size
+ */
+void mm_get_stats(mm_stats_t *st)
+{
+  int i;
+
+  st->extends = 0;
+  st->extend_size = 0;
+  st->probes = 0;
+  for (i = 0; i < narenas; i++) {
+    st->extends += arenas[i].nextend;
+    st->probes += arenas[i].nprobe;
+    st->extend_size = MAX(st->extend_size, arenas[i].grow);
   }
+}
 
-  oldsize = GET_SIZE(HDRP(ptr));
-  asize = MAX(ALIGN(size) + DSIZE, MINIMUM);
+/*
+ * mm_set_arenas - Split the heap into n arenas, binding threads to them
+ *    round robin, or by the CPU they run on if by_cpu is set.  Only
+ *    used in thread-safe mode; takes effect at the next mm_init.
+ */
+void mm_set_arenas(int n, int by_cpu)
+{
+  narenas = n < 1 ? 1 : n > MAX_ARENAS ? MAX_ARENAS : n;
+  arena_by_cpu = by_cpu;
+}
 
-  /* If the block size doesn't need to be changed, return the pointer */
-  if(oldsize == asize) {
-    return ptr;
+/*
+ * mm_malloc - Allocate a block with at least size bytes of payload,
+ *    from the thread cache when running thread safe
+ */
+void *mm_malloc(size_t size)
+{
+  tcache_t *tc;
+  arena_t *a;
+  void *bp;
+  int bin, i;
+
+  if (mmap_threshold && size > mmap_threshold)
+    return map_alloc(ALIGNMENT, size);
+  if (!threaded)
+    return heap_malloc(&arenas[0], size);
+  a = arena_get();
+  if (size <= 0 || size > TC_MAX) {
+    LOCK(a);
+    remote_drain(a);
+    bp = heap_malloc(a, size);
+    UNLOCK(a);
+    return bp;
   }
 
-  if(asize < oldsize) {
-    
-    if(oldsize - asize <= MINIMUM) {
-      return ptr;
+  tc = tcache_get();
+  bin = (size-1) / TC_STEP;
+  if (tc->bins[bin] == NULL) {
+    /* refill the bin with a batch of blocks from the heap */
+    LOCK(a);
+    remote_drain(a);
+    for (i = 0; i < TC_BATCH; i++) {
+      if ((bp = heap_malloc(a, (bin+1) * TC_STEP)) == NULL)
+        break;
+      TC_NEXT(bp) = tc->bins[bin];
+      tc->bins[bin] = bp;
+      tc->counts[bin]++;
     }
-    PUT(HDRP(ptr), PACK(asize, 1));
-    PUT(FTRP(ptr), PACK(asize, 1));
-    PUT(HDRP(NEXT_BLKP(ptr)), PACK(oldsize-asize, 1));
-    mm_free(NEXT_BLKP(ptr));
-    return ptr;
+    UNLOCK(a);
+    if (tc->bins[bin] == NULL)
+      return NULL;
   }
-
-  newptr = mm_malloc(size);
-
-  if(!newptr) {
-    return 0;
+  else if (__atomic_load_n(&a->nremote, __ATOMIC_RELAXED) > REMOTE_LIMIT) {
+    LOCK(a);
+    remote_drain(a);
+    UNLOCK(a);
   }
-
-  /* Copy the old data. */
-  if(size < oldsize) oldsize = size;
-  memcpy(newptr, ptr, oldsize);
-
-  /* Free the old block. */
-  mm_free(ptr);
-
-  return newptr;
+  bp = tc->bins[bin];
+  tc->bins[bin] = TC_NEXT(bp);
+  tc->counts[bin]--;
+  return bp;
 }
 
-/* 
- * checkheap - Minimal check of the heap for consistency 
+/*
+ * mm_memalign - Allocate a block with at least size bytes of payload
+ *    aligned to align, which must be a power of two
  */
-void mm_checkheap(int verbose)
+void *mm_memalign(size_t align, size_t size)
 {
-  //printf("mm_checkheap\n");
-  void *bp = heap_listp;
-
-  if (verbose)
-    printf("Heap (%p):\n", heap_listp);
-
-  if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(heap_listp)))
-    printf("Bad prologue header\n");
-  checkblock(heap_listp);
+  arena_t *a;
+  void *bp;
 
-  for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-    if (verbose) 
-      printblock(bp);
-    checkblock(bp);
+  if (align == 0 || (align & (align-1)) != 0 || align > MAX_HEAP) {
+    errno = EINVAL;
+    return NULL;
   }
+  if (align <= ALIGNMENT)
+    return mm_malloc(size);
+  if (size == 0)
+    return NULL;
+  if (mmap_threshold && size > mmap_threshold)
+    return map_alloc(align, size);
+  if (size > MAX_HEAP)
+    return NULL;
 
-  if (verbose)
-    printblock(bp);
-  if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
-    printf("Bad epilogue header\n");
+  a = threaded ? arena_get() : &arenas[0];
+  LOCK(a);
+  remote_drain(a);
+  bp = place_aligned(a, align, 0, ASIZE(size));
+  UNLOCK(a);
+  return bp;
 }
 
-/* 
- * extend_heap - Extend heap with free block, add the free block onto 
- * the free list and return its block pointer
+/*
+ * mm_posix_memalign - mm_memalign with posix_memalign's interface:
+ *    align must also be a multiple of sizeof(void *)
  */
-/* $begin mmextendheap */
-static void *extend_heap(size_t words) 
+int mm_posix_memalign(void **memptr, size_t align, size_t size)
 {
-  //printf("extend_heap\n");
-  char *bp;
-  size_t size;
-
-  /* Allocate an even number of words to maintain alignment */
-  size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
-  size = size < MINIMUM ? MINIMUM : size;
-  /* Get the physical block and error check */
-  if ((long)(bp = mem_sbrk(size)) == -1) 
-    return NULL;
+  void *bp;
 
-  /* Initialize free block header/footer and the epilogue header */
-  PUT(HDRP(bp), PACK(size, 0));         /* free block header */
-  PUT(FTRP(bp), PACK(size, 0));         /* free block footer */
-  PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* new epilogue header */
+  if (align % sizeof(void *) != 0 || align == 0 || (align & (align-1)) != 0)
+    return EINVAL;
+  if ((bp = mm_memalign(align, size)) == NULL && size != 0)
+    return ENOMEM;
+  *memptr = bp;
+  return 0;
+}
 
-  return coalesce(bp);
+/*
+ * mm_aligned_alloc - mm_memalign with C11 aligned_alloc's interface
+ */
+void *mm_aligned_alloc(size_t align, size_t size)
+{
+  return mm_memalign(align, size);
 }
-/* $end mmextendheap */
 
-/* 
- * place - Place block of asize bytes at start of free block bp 
- *         and split if remainder would be at least minimum block size
+/*
+ * mm_malloc_cacheline - Allocate size bytes on lines of their own: the
+ *    payload starts on a CACHE_LINE boundary and no other block's
+ *    payload shares any line it covers.
  */
-/* $begin mmplace */
-static void place(void *bp, size_t asize)
+void *mm_malloc_cacheline(size_t size)
 {
-  //printf("place\n");
-  size_t csize = GET_SIZE(HDRP(bp));
+  if (size == 0 || size > (size_t)-1 - CACHE_LINE)
+    return NULL;
+  return mm_memalign(CACHE_LINE, (size + CACHE_LINE-1) & ~(size_t)(CACHE_LINE-1));
+}
 
-  if ((csize - asize) >= (MINIMUM)) { 
-    PUT(HDRP(bp), PACK(asize, 1));
-    PUT(FTRP(bp), PACK(asize, 1));
-    fremove(bp);
-    bp = NEXT_BLKP(bp);
-    PUT(HDRP(bp), PACK(csize-asize, 0));
-    PUT(FTRP(bp), PACK(csize-asize, 0));
-    coalesce(bp);
-  }
-  else { 
-    PUT(HDRP(bp), PACK(csize, 1));
-    PUT(FTRP(bp), PACK(csize, 1));
-    fremove(bp);
-  }
+/*
+ * mm_malloc_usable_size - Payload bytes the allocated block ptr really
+ *    has, which may be more than was asked for; 0 for NULL
+ */
+size_t mm_malloc_usable_size(void *ptr)
+{
+  return ptr == NULL ? 0 : usable_size(ptr);
 }
-/* $end mmplace */
 
-/* 
- * find_fit - Find a fit for a block with asize bytes 
+/*
+ * mm_malloc_usable - mm_malloc that also stores the usable size of the
+ *    new block in *usable, or 0 if it fails
  */
-static void *find_fit(size_t asize)
-{ 
-  //printf("find_fit\n");
-  /* first fit search */ 
-  void *bp;
-              /* for loop ends at prologue (which is the permanent tail) */
-  for(bp = free_listp; GET_ALLOC(HDRP(bp)) == 0; bp = SUCC(bp)) { 
-    if (asize <= (size_t) GET_SIZE(HDRP(bp))) {
-      return bp;
-    }
-  }  
+void *mm_malloc_usable(size_t size, size_t *usable)
+{
+  void *bp = mm_malloc(size);
 
-  return NULL; /* no fit */
+  *usable = mm_malloc_usable_size(bp);
+  return bp;
 }
 
 /*
- * coalese - boundary tag coalescing. Return ptr to coalesced block
+ * mm_malloc_batch - Allocate n blocks of at least size bytes each into
+ *    out[0..n-1], carving as many as fit from each free block found.
+ *    Returns the number of blocks allocated, n unless memory ran out.
  */
- 
-static void *coalesce(void *bp) 
+int mm_malloc_batch(size_t size, int n, void **out)
 {
-  //printf("coalesce\n");
-  size_t prev_alloc;
-  prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp))) || PREV_BLKP(bp) == bp;
-  size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
-  size_t size = GET_SIZE(HDRP(bp));
-
-  if (prev_alloc && next_alloc) {                /* Case 1 */
-      fcons(bp);
-    return bp;
-  }
+  arena_t *a;
+  size_t asize;
+  int i = 0, k;
 
-  if (prev_alloc && !next_alloc) {               /* Case 2 */
-    size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-    fremove(NEXT_BLKP(bp));
-    PUT(HDRP(bp), PACK(size, 0));
-    PUT(FTRP(bp), PACK(size, 0));
+  if (size <= 0 || n <= 0)
+    return 0;
+  if (mmap_threshold && size > mmap_threshold) {
+    for (i = 0; i < n && (out[i] = map_alloc(ALIGNMENT, size)) != NULL; i++)
+      ;
+    return i;
   }
 
-  else if (!prev_alloc && next_alloc) {          /* Case 3 */
-    size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-    bp = PREV_BLKP(bp);
-    fremove(bp);
-    PUT(HDRP(bp), PACK(size, 0));
-    PUT(FTRP(bp), PACK(size, 0));
+  a = threaded ? arena_get() : &arenas[0];
+  asize = ASIZE(size);
+  LOCK(a);
+  remote_drain(a);
+  if (size <= SLAB_MAX) {
+    for (i = 0; i < n && (out[i] = slab_alloc(a, size)) != NULL; i++)
+      ;
   }
-
-  else {                                        /* Case 4 */
-    size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
-        GET_SIZE(HDRP(NEXT_BLKP(bp)));
-    fremove(PREV_BLKP(bp));
-    fremove(NEXT_BLKP(bp));
-    bp = PREV_BLKP(bp);
-    PUT(HDRP(bp), PACK(size, 0));
-    PUT(FTRP(bp), PACK(size, 0));
+  else {
+    /* quick listed blocks of this size go first */
+    if (asize < QL_MAX) {
+      for (; i < n && a->quick[asize / DSIZE] != NULL; i++) {
+        out[i] = a->quick[asize / DSIZE];
+        a->quick[asize / DSIZE] = QL_NEXT(out[i]);
+        a->nquick[asize / DSIZE]--;
+        PUT(HDRP(out[i]), GET(HDRP(out[i])) & ~KNOWN_ZERO);
+      }
+    }
+    for (; i < n; i += k) {
+      if ((k = carve(a, asize, MIN(n - i, MAX(BATCH_SPAN / asize, 1)), out + i)) == 0)
+        break;
+    }
   }
-  fcons(bp);
-  return bp;
+  UNLOCK(a);
+  return i;
 }
 
 /*
- * fcons - fcons the free block onto the head of the free_list 
+ * mm_free_batch - Free the n blocks in ptrs, which is sorted by address
+ *    in the process.  Each run of blocks that are heap neighbours is
+ *    freed as a single block.  NULL entries are skipped.
  */
-void fcons(void *bp)
+void mm_free_batch(void **ptrs, int n)
 {
-  //printf("fcons\n");
-  SUCC(bp) = free_listp; /* set bp successor */
-  PRED(free_listp) = bp; /* update head predecessor */
-  PRED(bp) = NULL; /* set bp predecessor */
-  free_listp = bp; /* update head global */
+  arena_t *a, *own;
+  int i, j;
+
+  if (n <= 0)
+    return;
+  qsort(ptrs, n, sizeof(void *), addr_cmp);
+  own = threaded ? arena_get() : &arenas[0];
+  LOCK(own);
+  for (i = 0; i < n; i = j) {
+    j = i + 1;
+    if (ptrs[i] == NULL)
+      continue;
+    if (IS_MAPPED(ptrs[i])) {
+      map_free(ptrs[i]);
+      continue;
+    }
+    a = threaded ? ARENA_OF(ptrs[i]) : own;
+    if (a != own) {
+      remote_push(a, ptrs[i]);
+      continue;
+    }
+    if (IS_SLAB(ptrs[i])) {
+      slab_free(a, ptrs[i]);
+      continue;
+    }
+    while (j < n && ptrs[j] == NEXT_BLKP(ptrs[j-1]) && !IS_SLAB(ptrs[j]))
+      j++;
+    free_run(a, ptrs + i, j - i);
+  }
+  remote_drain(own);
+  UNLOCK(own);
 }
 
 /*
- * fremove - fremove the free block from the free list 
+ * mm_free - Free a block, into the thread cache when running thread safe
  */
-void fremove(void *bp)
+void mm_free(void *bp)
 {
-  //printf("fremove\n");
-  if (PRED(bp)) {
-    SUCC(PRED(bp)) = SUCC(bp);
+  tcache_t *tc;
+  arena_t *a;
+  int bin;
+
+  if (bp == NULL)
+    return;
+  if (IS_MAPPED(bp)) {
+    map_free(bp);
+    return;
   }
-  else {
-    free_listp = SUCC(bp); 
+  if (!threaded) {
+    heap_free(&arenas[0], bp);
+    return;
+  }
+
+  /* usable_size() only reads fields that stay put while bp is
+     allocated, so it needs no lock */
+  bin = usable_size(bp) / TC_STEP - 1;
+  if (line_slabs && bin < SLAB_MAX / TC_STEP && !IS_SLAB(bp))
+    bin = -1; /* small bins hand out slab slots only */
+  if (bin < 0 || bin >= TC_BINS) {
+    a = ARENA_OF(bp);
+    if (a != arena_get()) {
+      remote_push(a, bp);
+      return;
+    }
+    LOCK(a);
+    remote_drain(a);
+    heap_free(a, bp);
+    UNLOCK(a);
+    return;
   }
-  PRED(SUCC(bp)) = PRED(bp);
 
+  tc = tcache_get();
+  TC_NEXT(bp) = tc->bins[bin];
+  tc->bins[bin] = bp;
+  if (++tc->counts[bin] > TC_LIMIT)
+    tcache_flush(tc, bin, TC_BATCH);
 }
 
-static void printblock(void *bp) 
+/*
+ * mm_free_sized - Free bp, which the caller asked for size bytes of,
+ *    without reading its header.  Only slab-sized requests need the
+ *    slab map.  Other small blocks go on the quick list for ASIZE(size),
+ *    and in thread-safe mode size picks the thread cache bin; either
+ *    way the list's size is at most the block's, so it is never too
+ *    big.  Blocks from mm_memalign must go through mm_free.
+ */
+void mm_free_sized(void *bp, size_t size)
 {
-  //printf("printblock\n");
-  size_t hsize;//, halloc, fsize, falloc;
+  tcache_t *tc;
+  arena_t *a;
+  int bin;
 
-  hsize = GET_SIZE(HDRP(bp));
-  //halloc = GET_ALLOC(HDRP(bp));  
-  //fsize = GET_SIZE(FTRP(bp));
-  //falloc = GET_ALLOC(FTRP(bp));  
+  if (bp == NULL)
+    return;
+#ifdef DEBUG
+  if (size > usable_size(bp) || (size > SLAB_MAX && IS_SLAB(bp)) ||
+      (!IS_SLAB(bp) && !IS_MAPPED(bp) && GET_SIZE(HDRP(bp)) > ASIZE(size) + 2*DSIZE))
+    printf("Error: mm_free_sized(%p, %zu) on a block of %zu bytes\n",
+           bp, size, usable_size(bp));
+#endif
+  if (IS_MAPPED(bp)) {
+    map_free(bp);
+    return;
+  }
+  if (!threaded) {
+    if (size <= SLAB_MAX)
+      heap_free(&arenas[0], bp);
+    else
+      quick_put(&arenas[0], bp, ASIZE(size));
+    return;
+  }
 
-  if (hsize == 0) {
-    //printf("%p: EOL\n", bp);
+  bin = size / TC_STEP - 1;
+  if (line_slabs && bin < SLAB_MAX / TC_STEP && !IS_SLAB(bp))
+    bin = -1;
+  if (bin < 0 || bin >= TC_BINS) {
+    a = ARENA_OF(bp);
+    if (a != arena_get()) {
+      remote_push(a, bp);
+      return;
+    }
+    LOCK(a);
+    remote_drain(a);
+    heap_free(a, bp);
+    UNLOCK(a);
     return;
   }
 
-  /*  //printf("%p: header: [%p:%c] footer: [%p:%c]\n", bp, 
-      hsize, (halloc ? 'a' : 'f'), 
-      fsize, (falloc ? 'a' : 'f')); */
+  tc = tcache_get();
+  TC_NEXT(bp) = tc->bins[bin];
+  tc->bins[bin] = bp;
+  if (++tc->counts[bin] > TC_LIMIT)
+    tcache_flush(tc, bin, TC_BATCH);
 }
 
-static void checkblock(void *bp) 
+/*
+ * mm_realloc - Resize a block within the arena that owns it; thread
+ *    caches are bypassed
+ */
+void *mm_realloc(void *ptr, size_t size)
 {
-  //printf("checkblock\n");
-  if ((size_t)bp % 8)
-    printf("Error: %p is not doubleword aligned\n", bp);
-  if (GET(HDRP(bp)) != GET(FTRP(bp)))
-    printf("Error: header does not match footer\n");
+  arena_t *a;
+  void *newptr;
+
+  if (ptr == NULL)
+    return mm_malloc(size);
+  if (IS_MAPPED(ptr) || (mmap_threshold && size > mmap_threshold))
+    return map_realloc(ptr, size);
+  a = threaded ? ARENA_OF(ptr) : &arenas[0];
+  LOCK(a);
+  remote_drain(a);
+  newptr = heap_realloc(a, ptr, size);
+  UNLOCK(a);
+  return newptr;
 }
 
 /*
- * mm_calloc
+ * heap_malloc - Allocate a block with at least size bytes of payload 
  */
-void *mm_calloc (size_t nmemb, size_t size)
+/* $begin mmmalloc */
+static void *heap_malloc(arena_t *a, size_t size)
 {
-  //printf("mm_calloc\n");
-  void *ptr;
-  if (heap_listp == 0){
-    mm_init();
+  //printf("mm_malloc\n");
+  size_t asize;      /* adjusted block size */
+  size_t extendsize; /* amount to extend heap if no fit */
+  char *bp;    
+
+  /* Ignore spurious requests, and ones mem_sbrk could never meet */
+  if (size <= 0 || size > MAX_HEAP)
+    return NULL;
+
+  /* Small requests are served from slabs */
+  if (size <= SLAB_MAX)
+    return slab_alloc(a, size);
+
+  /* Adjust block size to include overhead and alignment reqs. */
+  asize = ASIZE(size);
+
+  /* A quick listed block of this size is ready to go as it is */
+  if (asize < QL_MAX && (bp = a->quick[asize / DSIZE]) != NULL) {
+    a->quick[asize / DSIZE] = QL_NEXT(bp);
+    a->nquick[asize / DSIZE]--;
+    PUT(HDRP(bp), GET(HDRP(bp)) & ~KNOWN_ZERO); /* written since it was placed */
+    return bp;
+  }
+
+  /* Search the free list for a fit */
+  a->nmalloc++;
+  if ((bp = fit_or_flush(a, asize))) {
+    place(a, bp, asize);
+    return bp;
+  }
+
+  /* No fit found. Get more memory and place the block */
+  extendsize = grow_size(a, asize);
+  if ((bp = extend_heap(a, extendsize/WSIZE)) == NULL)
+    return NULL;
+  place(a, bp, asize);
+  return bp;
+} 
+/* $end mmmalloc */
+
+/* 
+ * heap_free - Free a block, onto its quick list if it is small
+ */
+/* $begin mmfree */
+static void heap_free(arena_t *a, void *bp)
+{
+  //printf("mm_free\n");
+  if(bp == 0) return;   /* Ignore free(NULL) */
+  if (IS_SLAB(bp)) {
+    slab_free(a, bp);
+    return;
+  }
+  quick_put(a, bp, GET_SIZE(HDRP(bp)));
+}
+/* $end mmfree */
+
+/*
+ * quick_put - Free the heap (not slab) block bp, parking it on the quick
+ *    list for size bytes if that is small enough.  size may fall short
+ *    of the block's own size by up to 2*DSIZE when mm_free_sized only
+ *    knows the request; the header is left alone, so a quick listed
+ *    block may still claim to be known zero until it is taken off.
+ */
+static void quick_put(arena_t *a, void *bp, size_t size)
+{
+  if (size < QL_MAX) {
+    QL_NEXT(bp) = a->quick[size / DSIZE];
+    a->quick[size / DSIZE] = bp;
+    if (++a->nquick[size / DSIZE] > QL_LIMIT)
+      quick_flush(a, size / DSIZE);
+    return;
+  }
+  free_block(a, bp);
+}
+
+/*
+ * free_block - Return the allocated block bp to the free lists now,
+ *    coalescing it with its neighbours
+ */
+static void free_block(arena_t *a, void *bp)
+{
+  size_t size = GET_SIZE(HDRP(bp));
+
+  PUT(HDRP(bp), PACK(size, 0) | GET_PREV_ALLOC(HDRP(bp)));
+  PUT(FTRP(bp), PACK(size, 0));
+  CLR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+  bp = coalesce(a, bp);
+  if (GET_SIZE(HDRP(bp)) >= TRIM_THRESHOLD && GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0)
+    trim(a, TRIM_PAD);
+}
+
+/*
+ * carve - Allocate up to n blocks of asize bytes into out from a single
+ *    free block and lay their headers down in one pass.  The free block
+ *    is the first to fit all n, or n/2, n/4, ... of them.  Only when not
+ *    even one block fits are the quick lists coalesced and the search
+ *    made again, and after that the heap grows.  Returns the number
+ *    allocated.
+ */
+static int carve(arena_t *a, size_t asize, int n, void **out)
+{
+  size_t csize, zero, prev_alloc;
+  void *bp, *first, *rest;
+  int i, k;
+
+  if (asize > MAX_HEAP)
+    return 0;
+  for (k = n; (bp = find_fit(a, k * asize)) == NULL && k > 1; k /= 2)
+    ;
+  if (bp == NULL && quick_flush(a, -1) > 0)
+    for (k = n; (bp = find_fit(a, k * asize)) == NULL && k > 1; k /= 2)
+      ;
+  if (bp == NULL && (bp = extend_heap(a, grow_size(a, n * asize)/WSIZE)) == NULL)
+    return 0;
+  n = MIN((size_t)n, GET_SIZE(HDRP(bp)) / asize);
+  a->nmalloc += n;
+
+  first = bp;
+  csize = GET_SIZE(HDRP(bp));
+  prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+  zero = zero_from(bp);
+  fremove(a, bp);
+  for (i = 0; i < n - 1; i++) {
+    PUT(HDRP(bp), PACK(asize, 1) | prev_alloc);
+    prev_alloc = PREV_ALLOC;
+    out[i] = bp;
+    bp += asize;
+    csize -= asize;
+  }
+
+  /* the last block takes the rest unless it can stand on its own */
+  out[i] = bp;
+  if (csize - asize >= MINIMUM) {
+    PUT(HDRP(bp), PACK(asize, 1) | prev_alloc);
+    rest = NEXT_BLKP(bp);
+    PUT(HDRP(rest), PACK(csize - asize, 0) | PREV_ALLOC);
+    PUT(FTRP(rest), PACK(csize - asize, 0));
+    fcons(a, rest);
+    if (zero)
+      set_zero(rest, zero > (size_t)(rest - first) ? zero - (rest - first) : 0);
+  }
+  else {
+    PUT(HDRP(bp), PACK(csize, 1) | prev_alloc);
+    SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+  }
+  return n;
+}
+
+/*
+ * free_run - Free the n allocated blocks at ptrs, each the heap
+ *    neighbour of the one before, as one block
+ */
+static void free_run(arena_t *a, void **ptrs, int n)
+{
+  void *last = ptrs[n-1];
+  size_t size = (last - ptrs[0]) + GET_SIZE(HDRP(last));
+
+  if (n == 1) {
+    heap_free(a, ptrs[0]);
+    return;
+  }
+  PUT(HDRP(ptrs[0]), PACK(size, 1) | GET_PREV_ALLOC(HDRP(ptrs[0])));
+  free_block(a, ptrs[0]);
+}
+
+/*
+ * addr_cmp - qsort order of block pointers by address
+ */
+static int addr_cmp(const void *x, const void *y)
+{
+  char *p = *(char * const *)x;
+  char *q = *(char * const *)y;
+
+  return (p > q) - (p < q);
+}
+
+/*
+ * trim - If arena a owns the segment at the top of the heap and that
+ *    segment ends in a free block, shrink the block to pad bytes (or
+ *    drop it entirely if pad is 0) and give the rest back to memlib.
+ *    Returns 1 if the heap shrank.
+ */
+static int trim(arena_t *a, size_t pad)
+{
+  size_t size, keep, zero;
+  void *bp;
+
+  keep = pad ? MAX(ALIGN(pad), MINIMUM) : 0;
+  SBRK_LOCK();
+  if (a->epilogue == NULL || a->epilogue + WSIZE != (char *)mem_heap_hi() + 1 ||
+      GET_PREV_ALLOC(a->epilogue)) {
+    SBRK_UNLOCK();
+    return 0;
+  }
+  bp = PREV_BLKP(a->epilogue + WSIZE);
+  size = GET_SIZE(HDRP(bp));
+  if (size < keep + MINIMUM) {
+    SBRK_UNLOCK();
+    return 0;
+  }
+
+  zero = zero_from(bp);
+  fremove(a, bp);
+  mem_shrink(size - keep);
+  if (keep) {
+    PUT(HDRP(bp), PACK(keep, 0) | GET_PREV_ALLOC(HDRP(bp)));
+    PUT(FTRP(bp), PACK(keep, 0));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));          /* new epilogue header */
+    a->epilogue = HDRP(NEXT_BLKP(bp));
+    fcons(a, bp);
+    if (zero)
+      set_zero(bp, zero);
+  }
+  else {
+    PUT(HDRP(bp), PACK(0, 1) | PREV_ALLOC);        /* new epilogue header */
+    a->epilogue = HDRP(bp);
+  }
+  SBRK_UNLOCK();
+  return 1;
+}
+
+/*
+ * quick_flush - coalesce every block on quick list number list, or on
+ *    all quick lists if list is -1.  Returns the number of blocks.
+ */
+static int quick_flush(arena_t *a, int list)
+{
+  int i, n = 0;
+  void *bp;
+
+  for (i = (list < 0 ? 0 : list); i < (list < 0 ? QL_LISTS : list+1); i++) {
+    while ((bp = a->quick[i]) != NULL) {
+      a->quick[i] = QL_NEXT(bp);
+      free_block(a, bp);
+      n++;
+    }
+    a->nquick[i] = 0;
+  }
+  return n;
+}
+
+/*
+ * fit_or_flush - find_fit, coalescing the quick lists and trying once
+ *    more if nothing fits
+ */
+static void *fit_or_flush(arena_t *a, size_t asize)
+{
+  void *bp;
+
+  if ((bp = find_fit(a, asize)) == NULL && quick_flush(a, -1) > 0)
+    bp = find_fit(a, asize);
+  return bp;
+}
+
+/*
+ * heap_realloc - Resize a block in place when it can shrink, absorb a
+ *    free neighbour or grow at the top of the heap; move it otherwise
+ */
+static void *heap_realloc(arena_t *a, void *ptr, size_t size)
+{
+  //printf("mm_realloc\n");
+  size_t oldsize;
+  size_t asize;
+  void *newptr;
+
+  /* If size == 0 then this is just free, and we return NULL. */
+  if(size <= 0) {
+    heap_free(a, ptr);
+    return 0;
+  }
+
+  /* If oldptr is NULL, then this is just malloc. */
+  if(ptr == NULL) {
+    return heap_malloc(a, size);
+  }
+
+  /* No heap block can grow this large; keep it from reaching mem_sbrk */
+  if (size > MAX_HEAP)
+    return 0;
+
+  if (IS_SLAB(ptr)) {
+    /* A slot can only be reused for a request of its own class */
+    oldsize = SLAB_OF(ptr)->size;
+    if (size <= oldsize && slab_class(size) == oldsize / SLAB_STEP - 1)
+      return ptr;
+  }
+  else if (line_slabs && size <= SLAB_MAX) {
+    /* A heap block may cross a line; a line slab slot never does */
+    oldsize = GET_SIZE(HDRP(ptr)) - WSIZE;
+  }
+  else {
+    oldsize = GET_SIZE(HDRP(ptr));
+    asize = ASIZE(size);
+
+    /* If the block size doesn't need to be changed, return the pointer */
+    if(oldsize == asize) {
+      return ptr;
+    }
+
+    if(asize < oldsize) {
+      
+      if(oldsize - asize <= MINIMUM) {
+        return ptr;
+      }
+      PUT(HDRP(ptr), PACK(asize, 1) | GET_PREV_ALLOC(HDRP(ptr)));
+      PUT(HDRP(NEXT_BLKP(ptr)), PACK(oldsize-asize, 1) | PREV_ALLOC);
+      free_block(a, NEXT_BLKP(ptr));
+      return ptr;
+    }
+
+    if (grow_in_place(a, ptr, asize))
+      return ptr;
+    oldsize -= WSIZE; /* payload bytes */
+
+    /* A large payload is moved to the same page offset, so that its
+       whole pages can be remapped rather than copied.  REMAP_MIN is
+       above MMAP_THRESHOLD, so this only runs once the threshold is
+       raised or turned off (mdriver -M 0 on traces/remap.rep). */
+    if (oldsize >= REMAP_MIN) {
+      if ((newptr = place_aligned(a, mem_pagesize(), (unsigned long)ptr, asize)) == NULL)
+        return 0;
+      move_payload(newptr, ptr, MIN(size, oldsize));
+      heap_free(a, ptr);
+      return newptr;
+    }
+  }
+
+  newptr = heap_malloc(a, size);
+
+  if(!newptr) {
+    return 0;
+  }
+
+  /* Copy the old data. */
+  if(size < oldsize) oldsize = size;
+  memcpy(newptr, ptr, oldsize);
+
+  /* Free the old block. */
+  heap_free(a, ptr);
+
+  return newptr;
+}
+
+/*
+ * move_payload - Move n payload bytes from src to dst, which share a
+ *    page offset.  Whole pages are remapped and only the partial pages
+ *    at either end are copied; src is garbage afterwards.
+ */
+static void move_payload(void *dst, void *src, size_t n)
+{
+  size_t page = mem_pagesize();
+  char *lo = (char *)(((unsigned long)src + page-1) & ~(unsigned long)(page-1));
+  char *hi = (char *)(((unsigned long)src + n) & ~(unsigned long)(page-1));
+  int moved = 0;
+
+  if (lo < hi) {
+    SBRK_LOCK();
+    moved = mem_move_pages(dst + (lo - (char *)src), lo, hi - lo) == 0;
+    SBRK_UNLOCK();
+  }
+  if (!moved) {
+    memcpy(dst, src, n);
+    return;
+  }
+  memcpy(dst, src, lo - (char *)src);
+  memcpy(dst + (hi - (char *)src), hi, (char *)src + n - hi);
+}
+
+/*
+ * grow_in_place - Grow the allocated block bp to asize bytes without
+ *    moving it.  A free right-hand neighbour is absorbed first; if the
+ *    block still falls short and then ends at the top of the heap, only
+ *    the missing bytes are sbrk'd.  Returns bp, or NULL if bp cannot
+ *    grow where it is.
+ */
+static void *grow_in_place(arena_t *a, void *bp, size_t asize)
+{
+  size_t csize = GET_SIZE(HDRP(bp));
+  void *next = NEXT_BLKP(bp);
+  size_t nsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+  void *end = next + nsize;  /* block after bp and its free neighbour */
+  size_t delta;
+  char *brk;
+
+  if (asize > MAX_HEAP)
+    return NULL;
+  if (csize + nsize < asize) {
+    /* end must be the epilogue of the segment at the top of the heap */
+    delta = asize - csize - nsize;
+    SBRK_LOCK();
+    if (HDRP(end) != a->epilogue || a->epilogue + WSIZE != (char *)mem_heap_hi() + 1 ||
+        (brk = mem_sbrk(delta)) == (void *)-1) {
+      SBRK_UNLOCK();
+      return NULL;
+    }
+    arena_claim(a, brk, delta);
+    SBRK_UNLOCK();
+
+    if (nsize)
+      fremove(a, next);
+    PUT(HDRP(bp), PACK(asize, 1) | GET_PREV_ALLOC(HDRP(bp)));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1) | PREV_ALLOC); /* new epilogue header */
+    a->epilogue = HDRP(NEXT_BLKP(bp));
+    return bp;
+  }
+
+  /* the free neighbour is big enough; split off what is left over */
+  fremove(a, next);
+  if (csize + nsize - asize >= MINIMUM) {
+    PUT(HDRP(bp), PACK(asize, 1) | GET_PREV_ALLOC(HDRP(bp)));
+    next = NEXT_BLKP(bp);
+    PUT(HDRP(next), PACK(csize + nsize - asize, 0) | PREV_ALLOC);
+    PUT(FTRP(next), PACK(csize + nsize - asize, 0));
+    fcons(a, next);
+  }
+  else {
+    PUT(HDRP(bp), PACK(csize + nsize, 1) | GET_PREV_ALLOC(HDRP(bp)));
+    SET_PREV_ALLOC(HDRP(end));
+  }
+  return bp;
+}
+
+/*
+ * map_alloc - Allocate a block with at least size bytes of payload
+ *    aligned to align in a region of its own.  The region starts on a
+ *    page boundary, so the payload is never more than align bytes in.
+ */
+static void *map_alloc(size_t align, size_t size)
+{
+  size_t page = mem_pagesize();
+  size_t lead = MAX(align, DSIZE);
+  size_t msize = (size + lead + page - 1) & ~(page - 1);
+  char *p, *bp;
+
+  if (msize < size || msize > 0xfffffff8)
+    return NULL;
+  SBRK_LOCK();
+  p = mem_map(msize);
+  SBRK_UNLOCK();
+  if (p == NULL)
+    return NULL;
+  bp = (char *)(((unsigned long)p + DSIZE + lead-1) & ~(unsigned long)(lead-1));
+  MAP_LEAD(bp) = bp - p;
+  PUT(HDRP(bp), PACK(msize, 1) | PREV_ALLOC);
+  return bp;
+}
+
+/*
+ * map_free - Unmap the region holding the mapped block bp
+ */
+static void map_free(void *bp)
+{
+  size_t msize = GET_SIZE(HDRP(bp));
+
+  SBRK_LOCK();
+  mem_unmap(bp - MAP_LEAD(bp), msize);
+  SBRK_UNLOCK();
+}
+
+/*
+ * map_realloc - Resize a block that is mapped, or is to become mapped.
+ *    A mapped block stays put while size still fits and is still over
+ *    the threshold, and is remapped by the system if it has to grow;
+ *    anything else is moved.
+ */
+static void *map_realloc(void *ptr, size_t size)
+{
+  size_t oldsize = usable_size(ptr);
+  size_t page = mem_pagesize();
+  size_t lead, msize;
+  char *p;
+  void *newptr;
+
+  if (size == 0) {
+    mm_free(ptr);
+    return NULL;
+  }
+  if (IS_MAPPED(ptr) && size > mmap_threshold) {
+    if (size <= oldsize)
+      return ptr;
+
+    /* let the system move the pages; the payload keeps its offset */
+    lead = MAP_LEAD(ptr);
+    msize = (size + lead + page - 1) & ~(page - 1);
+    if (msize < size || msize > 0xfffffff8)
+      return NULL;
+    SBRK_LOCK();
+    p = mem_remap(ptr - lead, GET_SIZE(HDRP(ptr)), msize);
+    SBRK_UNLOCK();
+    if (p != NULL) {
+      PUT(HDRP(p + lead), PACK(msize, 1) | PREV_ALLOC);
+      return p + lead;
+    }
+  }
+  if ((newptr = mm_malloc(size)) == NULL)
+    return NULL;
+  memcpy(newptr, ptr, MIN(size, oldsize));
+  mm_free(ptr);
+  return newptr;
+}
+
+/* 
+ * checkheap - Minimal check of the heap for consistency 
+ */
+void mm_checkheap(int verbose)
+{
+  //printf("mm_checkheap\n");
+  void *bp = heap_listp;
+  int nfree = 0, nlisted = 0;
+  int prev_alloc;
+  int i;
+
+  for (i = 0; i < narenas; i++) {
+    LOCK(&arenas[i]);
+    remote_drain(&arenas[i]);
+  }
+  if (verbose)
+    printf("Heap (%p):\n", heap_listp);
+
+  /* walk the segments in address order; each one after the first
+     starts on the first ARENA_PAGE boundary after the previous one */
+  while (1) {
+    if ((GET_SIZE(HDRP(bp)) != DSIZE) || !GET_ALLOC(HDRP(bp)))
+      printf("Bad prologue header\n");
+    checkblock(bp);
+
+    prev_alloc = 1;
+    for (bp = NEXT_BLKP(bp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+      if (verbose) 
+        printblock(bp);
+      checkblock(bp);
+      if (!GET_PREV_ALLOC(HDRP(bp)) != !prev_alloc)
+        printf("Error: %p prev-alloc bit does not match previous block\n", bp);
+      if (!prev_alloc && !GET_ALLOC(HDRP(bp)))
+        printf("Error: %p and its previous block are both free\n", bp);
+      if (ARENA_OF(HDRP(bp)) != ARENA_OF(HDRP(NEXT_BLKP(bp))))
+        printf("Error: %p straddles two arenas\n", bp);
+      prev_alloc = GET_ALLOC(HDRP(bp));
+      if (!prev_alloc)
+        nfree++;
+    }
+
+    if (verbose)
+      printblock(bp);
+    if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
+      printf("Bad epilogue header\n");
+    if (!GET_PREV_ALLOC(HDRP(bp)) != !prev_alloc)
+      printf("Error: epilogue prev-alloc bit does not match last block\n");
+
+    if (bp > mem_heap_hi())
+      break;
+    bp = (void *)(page_base + ARENA_PAGE_OF(bp + ARENA_PAGE-1) * ARENA_PAGE + DSIZE);
+  }
+
+  for (i = 0; i < narenas; i++) {
+    nlisted += checklists(&arenas[i]);
+    checkslabs(&arenas[i]);
+    checkquick(&arenas[i]);
+  }
+  if (nlisted != nfree)
+    printf("Error: %d free blocks in heap but %d on the free lists\n",
+           nfree, nlisted);
+  for (i = narenas-1; i >= 0; i--)
+    UNLOCK(&arenas[i]);
+}
+
+/* 
+ * extend_heap - Extend heap with free block, add the free block onto 
+ * the free list and return its block pointer.  The arena's newest
+ * segment grows in place while nothing has been allocated after it;
+ * otherwise the arena starts a new segment at the top of the heap.
+ */
+/* $begin mmextendheap */
+static void *extend_heap(arena_t *a, size_t words) 
+{
+  //printf("extend_heap\n");
+  char *bp, *fresh;
+  size_t size;
+
+  /* Allocate an even number of words to maintain alignment */
+  size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
+  size = size < MINIMUM ? MINIMUM : size;
+
+  SBRK_LOCK();
+  if ((a->epilogue == NULL || a->epilogue + WSIZE != (char *)mem_heap_hi() + 1) &&
+      new_segment(a) == NULL) {
+    SBRK_UNLOCK();
+    return NULL;
+  }
+  /* Get the physical block and error check */
+  fresh = mem_heap_hwm();
+  if ((long)(bp = mem_sbrk(size)) == -1) {
+    SBRK_UNLOCK();
+    return NULL;
+  }
+  arena_claim(a, bp, size);
+  SBRK_UNLOCK();
+  a->nextend++;
+
+  /* Initialize free block header/footer and the epilogue header.
+     The old epilogue header still knows whether the last block is
+     allocated. */
+  PUT(HDRP(bp), PACK(size, 0) | GET_PREV_ALLOC(HDRP(bp))); /* free block header */
+  PUT(FTRP(bp), PACK(size, 0));                            /* free block footer */
+  PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));                    /* new epilogue header */
+  a->epilogue = HDRP(NEXT_BLKP(bp));
+  set_zero(bp, fresh > bp ? fresh - bp : 0);
+
+  return coalesce(a, bp);
+}
+
+/*
+ * grow_size - bytes to extend arena a by for a request of asize bytes.
+ *    Doubles the arena's extension size if the last extension was less
+ *    than GROW_BURST allocations ago, halves it otherwise.  Small heaps
+ *    stay small: no extension is more than 1/GROW_FRAC of the heap.
+ */
+static size_t grow_size(arena_t *a, size_t asize)
+{
+  size_t cap = MAX(ALIGN(mem_heapsize() / GROW_FRAC), GROW_MIN);
+
+  if (a->nmalloc - a->last_grow < GROW_BURST)
+    a->grow = MIN(2 * a->grow, MIN(cap, GROW_MAX));
+  else
+    a->grow = MAX(a->grow / 2, GROW_MIN);
+  a->last_grow = a->nmalloc;
+  return MAX(asize, a->grow);
+}
+/* $end mmextendheap */
+
+/*
+ * new_segment - Start a new, empty segment for arena a at the top of
+ *    the heap and return its prologue block.  Every segment but the
+ *    first starts on an ARENA_PAGE boundary so that no page is shared
+ *    by two arenas.  Called with the sbrk lock held.
+ */
+static void *new_segment(arena_t *a)
+{
+  unsigned long brk = (unsigned long)mem_heap_hi() + 1;
+  size_t pad = 0;
+  char *sp;
+
+  if (mem_heapsize() > 0)
+    pad = (ARENA_PAGE - (brk - page_base) % ARENA_PAGE) % ARENA_PAGE;
+  if ((sp = mem_sbrk(pad + 4*WSIZE)) == (void *)-1)
+    return NULL;
+  sp += pad;
+  arena_claim(a, sp, 4*WSIZE);
+
+  PUT(sp, 0);                                   /* alignment padding */
+  PUT(sp + WSIZE, PACK(DSIZE, 1) | PREV_ALLOC);   /* prologue header */ 
+  PUT(sp + DSIZE, PACK(DSIZE, 1));                /* prologue footer */ 
+  PUT(sp + DSIZE+WSIZE, PACK(0, 1) | PREV_ALLOC); /* epilogue header */
+  a->epilogue = sp + DSIZE+WSIZE;
+  return sp + DSIZE;
+}
+
+/*
+ * arena_claim - Record arena a as the owner of the pages of [lo, lo+size)
+ */
+static void arena_claim(arena_t *a, void *lo, size_t size)
+{
+  unsigned long page;
+
+  for (page = ARENA_PAGE_OF(lo); page <= ARENA_PAGE_OF(lo + size - 1); page++)
+    arena_map[page] = a - arenas;
+}
+
+/* 
+ * place - Place block of asize bytes at start of free block bp 
+ *         and split if remainder would be at least minimum block size
+ */
+/* $begin mmplace */
+static void place(arena_t *a, void *bp, size_t asize)
+{
+  //printf("place\n");
+  size_t csize = GET_SIZE(HDRP(bp));
+
+  size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+  size_t zero = zero_from(bp);
+  void *rest;
+
+  fremove(a, bp);
+  if ((csize - asize) >= (MINIMUM)) { 
+    PUT(HDRP(bp), PACK(asize, 1) | prev_alloc);
+    rest = NEXT_BLKP(bp);
+    PUT(HDRP(rest), PACK(csize-asize, 0) | PREV_ALLOC);
+    PUT(FTRP(rest), PACK(csize-asize, 0));
+    fcons(a, rest);
+    if (zero) {
+      set_zero(bp, zero);
+      set_zero(rest, zero > asize ? zero - asize : 0);
+    }
+  }
+  else { 
+    if (zero)
+      PUT(FTRP(bp), 0); /* the footer becomes payload */
+    PUT(HDRP(bp), PACK(csize, 1) | prev_alloc);
+    SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+    if (zero)
+      set_zero(bp, zero);
+  }
+}
+/* $end mmplace */
+
+/*
+ * place_aligned - Allocate a block of asize bytes whose payload lies
+ *    off bytes past a multiple of align (a power of two larger than
+ *    ALIGNMENT), so off 0 aligns it.  The leading slack in front of the
+ *    aligned payload is split off as a free block of its own instead of
+ *    being wasted.
+ */
+static void *place_aligned(arena_t *a, size_t align, size_t off, size_t asize)
+{
+  size_t need = asize + align + MINIMUM;
+  size_t csize, lead, zero;
+  void *bp, *abp;
+
+  a->nmalloc++;
+  if ((bp = fit_or_flush(a, need)) == NULL &&
+      (bp = extend_heap(a, grow_size(a, need)/WSIZE)) == NULL)
+    return NULL;
+
+  abp = bp + ((off - (unsigned long)bp) & (align-1));
+  if (abp != bp && abp - bp < MINIMUM)
+    abp += align;
+
+  if (abp != bp) {
+    csize = GET_SIZE(HDRP(bp));
+    zero = zero_from(bp);
+    lead = abp - bp;
+    fremove(a, bp);
+    PUT(HDRP(bp), PACK(lead, 0) | GET_PREV_ALLOC(HDRP(bp)));
+    PUT(FTRP(bp), PACK(lead, 0));
+    fcons(a, bp);
+    PUT(HDRP(abp), PACK(csize-lead, 0));
+    PUT(FTRP(abp), PACK(csize-lead, 0));
+    fcons(a, abp);
+    if (zero) {
+      set_zero(bp, zero);
+      set_zero(abp, zero > lead ? zero - lead : 0);
+    }
+  }
+  place(a, abp, asize);
+  return abp;
+}
+
+/* 
+ * find_fit - Find a fit for a block with asize bytes in bounded time.
+ *    The request's own list is probed first, up to fit_probes+1 blocks;
+ *    otherwise the request is rounded up to the next list boundary so
+ *    that every block of any list found through the bitmaps fits, and
+ *    good_fit picks among the first fit_probes+1 of them.
+ */
+static void *find_fit(arena_t *a, size_t asize)
+{ 
+  //printf("find_fit\n");
+  void *bp;
+  int class, fl, sl;
+  unsigned int map;
+
+  if (asize >= TREE_MIN)
+    return tree_best_fit(a, asize);
+
+  class = size_class(asize);
+  if ((bp = good_fit(a, a->seg_lists[class], asize, fit_probes)) != NULL)
+    return bp;
+
+  if (class % SL_COUNT == SL_COUNT-1) {
+    fl = class / SL_COUNT + 1;
+    sl = 0;
+  }
+  else {
+    fl = class / SL_COUNT;
+    sl = class % SL_COUNT + 1;
+  }
+  if (fl >= FL_COUNT)
+    return NULL;
+
+  map = a->sl_bitmap[fl] & (~0U << sl);
+  if (map == 0) {
+    map = (fl+1 < FL_COUNT) ? a->fl_bitmap & (~0U << (fl+1)) : 0;
+    if (map == 0)
+      return tree_best_fit(a, asize);
+    fl = __builtin_ctz(map);
+    map = a->sl_bitmap[fl];
+  }
+  sl = __builtin_ctz(map);
+
+  return good_fit(a, a->seg_lists[fl * SL_COUNT + sl], asize, fit_probes);
+}
+
+/*
+ * good_fit - Walk at most probes+1 blocks of the free list starting at
+ *    bp and return the smallest one of at least asize bytes, or NULL.
+ *    A block that would leave less than MINIMUM bytes over ends the
+ *    walk, since no other block can do better.
+ */
+static void *good_fit(arena_t *a, void *bp, size_t asize, int probes)
+{
+  void *best = NULL, *next;
+  size_t size, bsize = 0, nsize = 0;
+
+  /* with packed sizes only the first block's size comes from a header */
+  if (bp != NULL && packed_sizes)
+    nsize = GET_SIZE(HDRP(bp));
+  for (; bp != NULL && probes >= 0; bp = next, probes--) {
+    /* start on the next block's miss before working on this one */
+    size = nsize;
+    if ((next = SUCC(bp)) != NULL) {
+      PREFETCH(next);
+      if (!packed_sizes)
+        PREFETCH(HDRP(next));
+    }
+    a->nprobe++;
+    if (packed_sizes)
+      nsize = SUCC_SIZE(bp);
+    else
+      size = GET_SIZE(HDRP(bp));
+    if (size < asize || (best != NULL && size >= bsize))
+      continue;
+    best = bp;
+    bsize = size;
+    if (bsize - asize < MINIMUM)
+      break;
+  }
+  return best;
+}
+
+/*
+ * coalese - boundary tag coalescing. Return ptr to coalesced block
+ */
+ 
+static void *coalesce(arena_t *a, void *bp) 
+{
+  //printf("coalesce\n");
+  size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+  size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+  size_t size = GET_SIZE(HDRP(bp));
+  size_t zero = zero_from(bp);
+  void *prev, *next = NEXT_BLKP(bp);
+
+  if (prev_alloc && next_alloc) {                /* Case 1 */
+      fcons(a, bp);
+    return bp;
+  }
+
+  if (prev_alloc && !next_alloc) {               /* Case 2 */
+    size += GET_SIZE(HDRP(next));
+    fremove(a, next);
+    zero = zero_merge(bp, zero, next, zero_from(next));
+    PUT(HDRP(bp), PACK(size, 0) | PREV_ALLOC);
+    PUT(FTRP(bp), PACK(size, 0));
+  }
+
+  else if (!prev_alloc && next_alloc) {          /* Case 3 */
+    prev = PREV_BLKP(bp);
+    size += GET_SIZE(HDRP(prev));
+    fremove(a, prev);
+    zero = zero_merge(prev, zero_from(prev), bp, zero);
+    bp = prev;
+    PUT(HDRP(bp), PACK(size, 0) | PREV_ALLOC);
+    PUT(FTRP(bp), PACK(size, 0));
+  }
+
+  else {                                        /* Case 4 */
+    prev = PREV_BLKP(bp);
+    size += GET_SIZE(HDRP(prev)) + GET_SIZE(HDRP(next));
+    fremove(a, prev);
+    fremove(a, next);
+    zero = zero_merge(bp, zero, next, zero_from(next));
+    zero = zero_merge(prev, zero_from(prev), bp, zero);
+    bp = prev;
+    PUT(HDRP(bp), PACK(size, 0) | PREV_ALLOC);
+    PUT(FTRP(bp), PACK(size, 0));
+  }
+  fcons(a, bp);
+  if (zero)
+    set_zero(bp, zero);
+  return bp;
+}
+
+/*
+ * zero_from - payload offset from which block bp is known to be zero,
+ *    or 0 if nothing is known
+ */
+static size_t zero_from(void *bp)
+{
+  return (GET(HDRP(bp)) & KNOWN_ZERO) ? ZERO_AT(bp) : 0;
+}
+
+/*
+ * set_zero - record that block bp is zero from payload offset off on.
+ *    The mark is dropped if no zero bytes would be left past ZERO_SKIP.
+ */
+static void set_zero(void *bp, size_t off)
+{
+  size_t end = GET_SIZE(HDRP(bp)) - (GET_ALLOC(HDRP(bp)) ? WSIZE : DSIZE);
+
+  off = MAX(off, ZERO_SKIP);
+  if (off < end) {
+    PUT(HDRP(bp), GET(HDRP(bp)) | KNOWN_ZERO);
+    ZERO_AT(bp) = off;
+  }
+  else
+    PUT(HDRP(bp), GET(HDRP(bp)) & ~KNOWN_ZERO);
+}
+
+/*
+ * zero_merge - zero offset of the free block lo (zlo) once it absorbs
+ *    the free block hi right after it (zhi), both off their lists.  If
+ *    hi is zero past its links, clearing lo's footer, hi's header and
+ *    hi's links keeps lo's offset; otherwise only hi's zero tail is left.
+ */
+static size_t zero_merge(void *lo, size_t zlo, void *hi, size_t zhi)
+{
+  if (zhi == 0)
+    return 0;
+  if (zlo != 0 && zhi == ZERO_SKIP) {
+    memset(HDRP(hi) - WSIZE, 0, DSIZE + ZERO_SKIP);
+    return zlo;
+  }
+  return (hi - lo) + zhi;
+}
+
+/*
+ * fls_size - index of the most significant set bit of a nonzero size
+ */
+static int fls_size(size_t size)
+{
+  return 8*sizeof(long) - 1 - __builtin_clzl(size);
+}
+
+/*
+ * size_class - map a block size onto its list index fl*SL_COUNT+sl.
+ *    Row 0 splits [0, 1<<FL_SHIFT) linearly in steps of ALIGNMENT; row
+ *    fl > 0 splits [2^(fl+FL_SHIFT-1), 2^(fl+FL_SHIFT)) into SL_COUNT
+ *    equal ranges.
+ */
+static int size_class(size_t size)
+{
+  int fl, sl;
+
+  if (size < (1 << FL_SHIFT))
+    return size / ALIGNMENT;
+  fl = fls_size(size);
+  sl = (size >> (fl - SL_LOG)) & (SL_COUNT-1);
+  return (fl - FL_SHIFT + 1) * SL_COUNT + sl;
+}
+
+/*
+ * fcons - fcons the free block onto the head of its class list, or
+ *    into its place in address order, found through the address index
+ */
+static void fcons(arena_t *a, void *bp)
+{
+  //printf("fcons\n");
+  int class;
+  void **headp;
+  void *pred = NULL;
+
+  if (GET_SIZE(HDRP(bp)) >= TREE_MIN) {
+    tree_insert(a, bp);
+    return;
+  }
+  class = size_class(GET_SIZE(HDRP(bp)));
+  headp = &a->seg_lists[class];
+
+  if (addr_order) {
+    unsigned long page = ARENA_PAGE_OF(bp);
+
+    pred = index_pred(a, class, bp);
+    if (!INDEX_HAS(a, class, page) || bp < INDEX_LOW(class, page)) {
+      index_low[page][class] = ((unsigned long)bp - page_base) % ARENA_PAGE / ALIGNMENT;
+      a->index_map[class][page / 64] |= 1UL << (page % 64);
+      a->index_top = MAX(a->index_top, page + 1);
+    }
+  }
+
+  if (pred) {
+    LINK(bp) = LINK(pred);
+    SET_PRED(bp, pred);
+    if (SUCC(pred))
+      SET_PRED(SUCC(pred), bp);
+    SET_SUCC(pred, bp);
+  }
+  else {
+    SET_SUCC(bp, *headp); /* set bp successor */
+    SET_PRED(bp, NULL); /* set bp predecessor */
+    if (*headp)
+      SET_PRED(*headp, bp); /* update head predecessor */
+    *headp = bp; /* update head of the class list */
+  }
+  a->sl_bitmap[class / SL_COUNT] |= 1U << (class % SL_COUNT);
+  a->fl_bitmap |= 1U << (class / SL_COUNT);
+}
+
+/*
+ * fremove - fremove the free block from its class list.  Must be called
+ *    while the header still holds the size the block was fconsed with.
+ */
+static void fremove(arena_t *a, void *bp)
+{
+  //printf("fremove\n");
+  if (GET_SIZE(HDRP(bp)) >= TREE_MIN) {
+    tree_remove(a, bp);
+    return;
+  }
+  if (addr_order) {
+    int class = size_class(GET_SIZE(HDRP(bp)));
+    unsigned long page = ARENA_PAGE_OF(bp);
+
+    /* the next block of the list, if on the same page, is its new lowest */
+    if (INDEX_LOW(class, page) == bp) {
+      if (SUCC(bp) && ARENA_PAGE_OF(SUCC(bp)) == page)
+        index_low[page][class] = ((unsigned long)SUCC(bp) - page_base) % ARENA_PAGE / ALIGNMENT;
+      else
+        a->index_map[class][page / 64] &= ~(1UL << (page % 64));
+    }
+  }
+  if (PRED(bp)) {
+    LINK(PRED(bp)) = LINK(bp);
+  }
+  else {
+    int class = size_class(GET_SIZE(HDRP(bp)));
+
+    a->seg_lists[class] = SUCC(bp); 
+    if (a->seg_lists[class] == NULL) {
+      a->sl_bitmap[class / SL_COUNT] &= ~(1U << (class % SL_COUNT));
+      if (a->sl_bitmap[class / SL_COUNT] == 0)
+        a->fl_bitmap &= ~(1U << (class / SL_COUNT));
+    }
+  }
+  if (SUCC(bp)) {
+    SET_PRED(SUCC(bp), PRED(bp));
+  }
+}
+
+/*
+ * index_pred - the block of list class that bp follows in address
+ *    order, or NULL if bp goes at the head.  The lowest listed block of
+ *    bp's page, or of the next page up that has one, pins the place
+ *    down; only when bp lies above every listed block of its page, or
+ *    above the whole list, are the blocks of one page walked.
+ */
+static void *index_pred(arena_t *a, int class, void *bp)
+{
+  unsigned long page = ARENA_PAGE_OF(bp);
+  void *pred;
+  long pg;
+
+  if (INDEX_HAS(a, class, page) && (pred = INDEX_LOW(class, page)) < bp)
+    ; /* bp goes after one of its own page's blocks */
+  else {
+    pg = INDEX_HAS(a, class, page) ? (long)page : index_above(a, class, page);
+    if (pg >= 0)
+      return PRED(INDEX_LOW(class, pg));
+    if ((pg = index_below(a, class, page)) < 0)
+      return NULL;
+    pred = INDEX_LOW(class, pg); /* the list ends on page pg */
+  }
+  while (SUCC(pred) && SUCC(pred) < bp)
+    pred = SUCC(pred);
+  return pred;
+}
+
+/*
+ * index_above - nearest page past page with a block of list class in
+ *    a's address index, or -1
+ */
+static long index_above(arena_t *a, int class, unsigned long page)
+{
+  unsigned long w = (page + 1) / 64, bits;
+
+  if (page + 1 >= a->index_top)
+    return -1;
+  bits = a->index_map[class][w] & (~0UL << ((page + 1) % 64));
+  while (bits == 0) {
+    if (++w * 64 >= a->index_top)
+      return -1;
+    bits = a->index_map[class][w];
+  }
+  return w * 64 + __builtin_ctzl(bits);
+}
+
+/*
+ * index_below - nearest page before page with a block of list class in
+ *    a's address index, or -1
+ */
+static long index_below(arena_t *a, int class, unsigned long page)
+{
+  unsigned long w, bits;
+
+  if (page == 0)
+    return -1;
+  w = (page - 1) / 64;
+  bits = a->index_map[class][w] & (~0UL >> (63 - (page - 1) % 64));
+  while (bits == 0) {
+    if (w-- == 0)
+      return -1;
+    bits = a->index_map[class][w];
+  }
+  return w * 64 + 63 - __builtin_clzl(bits);
+}
+
+/*
+ * tree_less - order of the large block tree: by size, then by address
+ */
+static int tree_less(void *a, void *b)
+{
+  size_t asize = GET_SIZE(HDRP(a));
+  size_t bsize = GET_SIZE(HDRP(b));
+
+  return asize < bsize || (asize == bsize && a < b);
+}
+
+static void tree_rotate_left(arena_t *a, void *x)
+{
+  void *y = RIGHT(x);
+
+  RIGHT(x) = LEFT(y);
+  if (LEFT(y))
+    PARENT(LEFT(y)) = x;
+  tree_transplant(a, x, y);
+  LEFT(y) = x;
+  PARENT(x) = y;
+}
+
+static void tree_rotate_right(arena_t *a, void *x)
+{
+  void *y = LEFT(x);
+
+  LEFT(x) = RIGHT(y);
+  if (RIGHT(y))
+    PARENT(RIGHT(y)) = x;
+  tree_transplant(a, x, y);
+  RIGHT(y) = x;
+  PARENT(x) = y;
+}
+
+/*
+ * tree_transplant - put subtree v where subtree u hangs from its parent
+ */
+static void tree_transplant(arena_t *a, void *u, void *v)
+{
+  void *up = PARENT(u);
+
+  if (up == NULL)
+    a->tree_root = v;
+  else if (u == LEFT(up))
+    LEFT(up) = v;
+  else
+    RIGHT(up) = v;
+  if (v)
+    PARENT(v) = up;
+}
+
+/*
+ * tree_insert - insert the free block z into the large block tree
+ */
+static void tree_insert(arena_t *a, void *z)
+{
+  void *x = a->tree_root;
+  void *p = NULL;
+  void *g, *u;
+
+  while (x) {
+    p = x;
+    x = tree_less(z, x) ? LEFT(x) : RIGHT(x);
+  }
+  PARENT(z) = p;
+  LEFT(z) = NULL;
+  RIGHT(z) = NULL;
+  COLOR(z) = RED;
+  if (p == NULL)
+    a->tree_root = z;
+  else if (tree_less(z, p))
+    LEFT(p) = z;
+  else
+    RIGHT(p) = z;
+
+  /* restore the red-black properties on the way up */
+  for (p = PARENT(z); IS_RED(p); p = PARENT(z)) {
+    g = PARENT(p);
+    if (p == LEFT(g)) {
+      u = RIGHT(g);
+      if (IS_RED(u)) {
+        COLOR(p) = BLACK;
+        COLOR(u) = BLACK;
+        COLOR(g) = RED;
+        z = g;
+        continue;
+      }
+      if (z == RIGHT(p)) {
+        tree_rotate_left(a, p);
+        z = p;
+        p = PARENT(z);
+      }
+      COLOR(p) = BLACK;
+      COLOR(g) = RED;
+      tree_rotate_right(a, g);
+    }
+    else {
+      u = LEFT(g);
+      if (IS_RED(u)) {
+        COLOR(p) = BLACK;
+        COLOR(u) = BLACK;
+        COLOR(g) = RED;
+        z = g;
+        continue;
+      }
+      if (z == LEFT(p)) {
+        tree_rotate_right(a, p);
+        z = p;
+        p = PARENT(z);
+      }
+      COLOR(p) = BLACK;
+      COLOR(g) = RED;
+      tree_rotate_left(a, g);
+    }
+  }
+  COLOR(a->tree_root) = BLACK;
+}
+
+/*
+ * tree_remove - unlink the free block z from the large block tree
+ */
+static void tree_remove(arena_t *a, void *z)
+{
+  void *y = z;
+  void *x, *xp, *w;
+  unsigned int removed = COLOR(z);
+
+  if (LEFT(z) == NULL) {
+    x = RIGHT(z);
+    xp = PARENT(z);
+    tree_transplant(a, z, x);
+  }
+  else if (RIGHT(z) == NULL) {
+    x = LEFT(z);
+    xp = PARENT(z);
+    tree_transplant(a, z, x);
+  }
+  else {
+    /* splice out z's successor y and put it in z's place */
+    for (y = RIGHT(z); LEFT(y); y = LEFT(y))
+      ;
+    removed = COLOR(y);
+    x = RIGHT(y);
+    if (PARENT(y) == z) {
+      xp = y;
+    }
+    else {
+      xp = PARENT(y);
+      tree_transplant(a, y, x);
+      RIGHT(y) = RIGHT(z);
+      PARENT(RIGHT(y)) = y;
+    }
+    tree_transplant(a, z, y);
+    LEFT(y) = LEFT(z);
+    PARENT(LEFT(y)) = y;
+    COLOR(y) = COLOR(z);
+  }
+  if (removed == RED)
+    return;
+
+  /* x carries an extra black; push it up until it can be absorbed */
+  while (x != a->tree_root && !IS_RED(x)) {
+    if (x == LEFT(xp)) {
+      w = RIGHT(xp);
+      if (IS_RED(w)) {
+        COLOR(w) = BLACK;
+        COLOR(xp) = RED;
+        tree_rotate_left(a, xp);
+        w = RIGHT(xp);
+      }
+      if (!IS_RED(LEFT(w)) && !IS_RED(RIGHT(w))) {
+        COLOR(w) = RED;
+        x = xp;
+        xp = PARENT(x);
+        continue;
+      }
+      if (!IS_RED(RIGHT(w))) {
+        COLOR(LEFT(w)) = BLACK;
+        COLOR(w) = RED;
+        tree_rotate_right(a, w);
+        w = RIGHT(xp);
+      }
+      COLOR(w) = COLOR(xp);
+      COLOR(xp) = BLACK;
+      COLOR(RIGHT(w)) = BLACK;
+      tree_rotate_left(a, xp);
+    }
+    else {
+      w = LEFT(xp);
+      if (IS_RED(w)) {
+        COLOR(w) = BLACK;
+        COLOR(xp) = RED;
+        tree_rotate_right(a, xp);
+        w = LEFT(xp);
+      }
+      if (!IS_RED(LEFT(w)) && !IS_RED(RIGHT(w))) {
+        COLOR(w) = RED;
+        x = xp;
+        xp = PARENT(x);
+        continue;
+      }
+      if (!IS_RED(LEFT(w))) {
+        COLOR(RIGHT(w)) = BLACK;
+        COLOR(w) = RED;
+        tree_rotate_left(a, w);
+        w = LEFT(xp);
+      }
+      COLOR(w) = COLOR(xp);
+      COLOR(xp) = BLACK;
+      COLOR(LEFT(w)) = BLACK;
+      tree_rotate_right(a, xp);
+    }
+    x = a->tree_root;
+  }
+  if (x)
+    COLOR(x) = BLACK;
+}
+
+/*
+ * tree_best_fit - smallest (then lowest addressed) block of at least asize
+ */
+static void *tree_best_fit(arena_t *a, size_t asize)
+{
+  void *x = a->tree_root;
+  void *best = NULL;
+
+  while (x) {
+    a->nprobe++;
+    if (GET_SIZE(HDRP(x)) >= asize) {
+      best = x;
+      x = LEFT(x);
+    }
+    else {
+      x = RIGHT(x);
+    }
+  }
+  return best;
+}
+
+/*
+ * slab_class - Slab class of a request of size bytes.  Cache line slabs
+ *    round the slot up to a power of two, which divides CACHE_LINE.
+ */
+static int slab_class(size_t size)
+{
+  if (line_slabs && size > SLAB_STEP)
+    size = 1UL << (8 * sizeof(long) - __builtin_clzl(size - 1));
+  return (size-1) / SLAB_STEP;
+}
+
+/*
+ * slab_alloc - Take a free slot of the right class, carving a new slab
+ *    out of the block heap when the class has none left
+ */
+static void *slab_alloc(arena_t *a, size_t size)
+{
+  int class = slab_class(size);
+  slab_t *s = a->slab_lists[class];
+  unsigned long page;
+  int i, slot;
+
+  /* A slab is a block of exactly SLAB_SIZE bytes, so the next block's
+     header takes the last word of the page and slabs carved from the
+     same free block tile the heap without any alignment slack. */
+  if (s == NULL) {
+    if ((s = place_aligned(a, SLAB_SIZE, 0, SLAB_SIZE)) == NULL)
+      return NULL;
+    s->size = (class+1) * SLAB_STEP;
+    s->nslots = (SLAB_SIZE - WSIZE - slab_start) / s->size;
+    s->nfree = s->nslots;
+    memset(s->bitmap, 0, sizeof(s->bitmap));
+    for (i = 0; i < s->nslots; i++)
+      s->bitmap[i / 64] |= 1UL << (i % 64);
+    s->next = NULL;
+    s->prev = NULL;
+    a->slab_lists[class] = s;
+    page = SLAB_PAGE(s);
+    slab_map[page / 8] |= 1 << (page % 8);
+  }
+
+  for (i = 0; s->bitmap[i] == 0; i++)
+    ;
+  slot = __builtin_ctzl(s->bitmap[i]);
+  s->bitmap[i] &= ~(1UL << slot);
+
+  /* a full slab leaves the list until one of its slots is freed */
+  if (--s->nfree == 0) {
+    a->slab_lists[class] = s->next;
+    if (s->next)
+      s->next->prev = NULL;
+  }
+  return SLAB_SLOTS(s) + (i*64 + slot) * s->size;
+}
+
+/*
+ * slab_free - Return slot p to its slab.  A slab whose slots are all
+ *    free is given back to the block heap unless it is the last slab
+ *    its class has on hand.
+ */
+static void slab_free(arena_t *a, void *p)
+{
+  slab_t *s = SLAB_OF(p);
+  int class = s->size / SLAB_STEP - 1;
+  int slot = ((char *)p - SLAB_SLOTS(s)) / s->size;
+  unsigned long page;
+
+  s->bitmap[slot / 64] |= 1UL << (slot % 64);
+  if (s->nfree++ == 0) {
+    s->prev = NULL;
+    s->next = a->slab_lists[class];
+    if (s->next)
+      s->next->prev = s;
+    a->slab_lists[class] = s;
+  }
+
+  if (s->nfree == s->nslots && (s->prev || s->next)) {
+    if (s->prev)
+      s->prev->next = s->next;
+    else
+      a->slab_lists[class] = s->next;
+    if (s->next)
+      s->next->prev = s->prev;
+    page = SLAB_PAGE(s);
+    slab_map[page / 8] &= ~(1 << (page % 8));
+    free_block(a, s);
+  }
+}
+
+/*
+ * slab_release - give every empty slab back to the block heap,
+ *    including the last one a class keeps on hand
+ */
+static void slab_release(arena_t *a)
+{
+  slab_t *s, *next;
+  unsigned long page;
+  int class;
+
+  for (class = 0; class < SLAB_CLASSES; class++) {
+    for (s = a->slab_lists[class]; s != NULL; s = next) {
+      next = s->next;
+      if (s->nfree != s->nslots)
+        continue;
+      if (s->prev)
+        s->prev->next = s->next;
+      else
+        a->slab_lists[class] = s->next;
+      if (s->next)
+        s->next->prev = s->prev;
+      page = SLAB_PAGE(s);
+      slab_map[page / 8] &= ~(1 << (page % 8));
+      free_block(a, s);
+    }
+  }
+}
+
+/*
+ * usable_size - payload bytes available in the allocated block bp
+ */
+static size_t usable_size(void *bp)
+{
+  if (IS_MAPPED(bp))
+    return GET_SIZE(HDRP(bp)) - MAP_LEAD(bp);
+  if (IS_SLAB(bp))
+    return SLAB_OF(bp)->size;
+  return GET_SIZE(HDRP(bp)) - WSIZE;
+}
+
+/*
+ * tcache_get - the calling thread's cache, emptied if its blocks
+ *    belong to a heap that mm_init has since thrown away
+ */
+static tcache_t *tcache_get(void)
+{
+  tcache_t *tc = &tcache;
+
+  if (tc->gen != heap_gen) {
+    if (tc->gen == 0) {
+      pthread_once(&tcache_once, tcache_key_init);
+      pthread_setspecific(tcache_key, tc);
+    }
+    memset(tc->bins, 0, sizeof(tc->bins));
+    memset(tc->counts, 0, sizeof(tc->counts));
+    tc->gen = heap_gen;
+    tc->arena = &arenas[__atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED) % narenas];
+  }
+  return tc;
+}
+
+/*
+ * arena_get - the arena the calling thread should allocate from
+ */
+static arena_t *arena_get(void)
+{
+  int cpu;
+
+  if (narenas == 1)
+    return &arenas[0];
+  if (arena_by_cpu && (cpu = sched_getcpu()) >= 0)
+    return &arenas[cpu % narenas];
+  return tcache_get()->arena;
+}
+
+/*
+ * arena_reset - empty arena a; its segments went away with the heap
+ */
+static void arena_reset(arena_t *a)
+{
+  int i;
+
+  memset(a->seg_lists, 0, sizeof(a->seg_lists));
+  memset(a->sl_bitmap, 0, sizeof(a->sl_bitmap));
+  a->fl_bitmap = 0;
+  a->tree_root = NULL;
+  memset(a->slab_lists, 0, sizeof(a->slab_lists));
+  memset(a->quick, 0, sizeof(a->quick));
+  memset(a->nquick, 0, sizeof(a->nquick));
+  a->epilogue = NULL;
+  a->remote = NULL;
+  a->nremote = 0;
+  a->grow = GROW_MIN;
+  a->nmalloc = 0;
+  a->last_grow = 0;
+  a->nextend = 0;
+  a->nprobe = 0;
+  if (a->index_top > 0) {
+    for (i = 0; i < LIST_CLASSES; i++)
+      memset(a->index_map[i], 0, (a->index_top + 63) / 64 * sizeof(unsigned long));
+    a->index_top = 0;
+  }
+}
+
+static void arena_lock_init(void)
+{
+  int i;
+
+  for (i = 0; i < MAX_ARENAS; i++)
+    pthread_mutex_init(&arenas[i].lock, NULL);
+}
+
+/*
+ * tcache_flush - give n blocks of a bin back to the arenas that own
+ *    them.  The thread's own arena is locked once for all of its
+ *    blocks; blocks of other arenas go on their remote stacks.
+ */
+static void tcache_flush(tcache_t *tc, int bin, int n)
+{
+  arena_t *a, *own = arena_get(), *locked = NULL;
+  void *bp;
+
+  while (n-- > 0 && (bp = tc->bins[bin]) != NULL) {
+    tc->bins[bin] = TC_NEXT(bp);
+    tc->counts[bin]--;
+    a = ARENA_OF(bp);
+    if (a != own) {
+      remote_push(a, bp);
+      continue;
+    }
+    if (a != locked) {
+      if (locked)
+        UNLOCK(locked);
+      LOCK(a);
+      locked = a;
+    }
+    heap_free(a, bp);
+  }
+  if (locked) {
+    remote_drain(locked);
+    UNLOCK(locked);
+  }
+}
+
+/*
+ * tcache_exit - pthread key destructor: return an exiting thread's
+ *    cached blocks to the heap
+ */
+static void tcache_exit(void *arg)
+{
+  tcache_t *tc = arg;
+  int bin;
+
+  if (tc->gen != heap_gen)
+    return;
+  for (bin = 0; bin < TC_BINS; bin++)
+    tcache_flush(tc, bin, tc->counts[bin]);
+}
+
+static void tcache_key_init(void)
+{
+  pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/*
+ * remote_push - hand the block bp back to its owner a without taking
+ *    a's lock.  Any number of threads may push at once.
+ */
+static void remote_push(arena_t *a, void *bp)
+{
+  void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+
+  do
+    TC_NEXT(bp) = head;
+  while (!__atomic_compare_exchange_n(&a->remote, &head, bp, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  __atomic_fetch_add(&a->nremote, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * remote_drain - free every block on a's remote stack.  Called with
+ *    a's lock held, so the stack has a single consumer and detaching
+ *    it whole with one exchange is safe against concurrent pushes.
+ */
+static void remote_drain(arena_t *a)
+{
+  void *bp, *next;
+  int n = 0;
+
+  if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) == NULL)
+    return;
+  for (bp = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+       bp != NULL; bp = next) {
+    next = TC_NEXT(bp);
+    heap_free(a, bp);
+    n++;
+  }
+  __atomic_fetch_sub(&a->nremote, n, __ATOMIC_RELAXED);
+}
+
+static void printblock(void *bp) 
+{
+  //printf("printblock\n");
+  size_t hsize;//, halloc, fsize, falloc;
+
+  hsize = GET_SIZE(HDRP(bp));
+  //halloc = GET_ALLOC(HDRP(bp));  
+  //fsize = GET_SIZE(FTRP(bp));
+  //falloc = GET_ALLOC(FTRP(bp));  
+
+  if (hsize == 0) {
+    //printf("%p: EOL\n", bp);
+    return;
+  }
+
+  /*  //printf("%p: header: [%p:%c] footer: [%p:%c]\n", bp, 
+      hsize, (halloc ? 'a' : 'f'), 
+      fsize, (falloc ? 'a' : 'f')); */
+}
+
+static void checkblock(void *bp) 
+{
+  //printf("checkblock\n");
+  if ((size_t)bp % 8)
+    printf("Error: %p is not doubleword aligned\n", bp);
+  if (!GET_ALLOC(HDRP(bp)) && GET(FTRP(bp)) != PACK(GET_SIZE(HDRP(bp)), 0))
+    printf("Error: header does not match footer\n");
+  if (!GET_ALLOC(HDRP(bp)) && zero_from(bp)) {
+    char *p;
+
+    for (p = bp + zero_from(bp); p < (char *)FTRP(bp); p++)
+      if (*p) {
+        printf("Error: known-zero block %p has a nonzero byte at %p\n", bp, p);
+        break;
+      }
+  }
+}
+
+/*
+ * checklists - every block on a class list must be free, sized for
+ *    that class and correctly linked to its neighbours.  Returns the
+ *    number of blocks found on the lists and in the tree.
+ */
+static int checklists(arena_t *a)
+{
+  void *bp;
+  int class;
+  int count = 0;
+
+  for (class = 0; class < NUM_CLASSES; class++) {
+    int mapped = (a->sl_bitmap[class / SL_COUNT] >> (class % SL_COUNT)) & 1;
+
+    if (mapped != (a->seg_lists[class] != NULL))
+      printf("Error: sl_bitmap out of sync for list %d\n", class);
+    if (class % SL_COUNT == 0 &&
+        ((a->fl_bitmap >> (class / SL_COUNT)) & 1) != (a->sl_bitmap[class / SL_COUNT] != 0))
+      printf("Error: fl_bitmap out of sync for row %d\n", class / SL_COUNT);
+    for (bp = a->seg_lists[class]; bp != NULL; bp = SUCC(bp)) {
+      if (GET_ALLOC(HDRP(bp)))
+        printf("Error: allocated block %p on free list %d\n", bp, class);
+      if (size_class(GET_SIZE(HDRP(bp))) != class)
+        printf("Error: block %p on wrong free list %d\n", bp, class);
+      if (SUCC(bp) && PRED(SUCC(bp)) != bp)
+        printf("Error: broken free list links at %p\n", bp);
+      if (addr_order && SUCC(bp) && SUCC(bp) < bp)
+        printf("Error: free list %d out of address order at %p\n", class, bp);
+      if (addr_order && (!INDEX_HAS(a, class, ARENA_PAGE_OF(bp)) ||
+                         INDEX_LOW(class, ARENA_PAGE_OF(bp)) > bp ||
+                         ((!PRED(bp) || ARENA_PAGE_OF(PRED(bp)) != ARENA_PAGE_OF(bp)) &&
+                          INDEX_LOW(class, ARENA_PAGE_OF(bp)) != bp)))
+        printf("Error: address index misses free block %p\n", bp);
+      if (packed_sizes && SUCC(bp) && SUCC_SIZE(bp) != GET_SIZE(HDRP(SUCC(bp))))
+        printf("Error: stale successor size in free block %p\n", bp);
+      count++;
+    }
+  }
+
+  if (IS_RED(a->tree_root))
+    printf("Error: red tree root\n");
+  if (a->tree_root && PARENT(a->tree_root) != NULL)
+    printf("Error: tree root has a parent\n");
+  checktree(a, a->tree_root, NULL, NULL, &count);
+  return count;
+}
+
+/*
+ * checkslabs - every slab with free slots must be on its class list,
+ *    marked in slab_map and have a bitmap that agrees with nfree.
+ *    Returns the number of slabs on the lists.
+ */
+static int checkslabs(arena_t *a)
+{
+  slab_t *s;
+  int class, i, nfree;
+  int count = 0;
+
+  for (class = 0; class < SLAB_CLASSES; class++) {
+    for (s = a->slab_lists[class]; s != NULL; s = s->next) {
+      if (!IS_SLAB(s) || (unsigned long)s % SLAB_SIZE)
+        printf("Error: slab %p is not a mapped slab page\n", s);
+      if (s->size != (class+1) * SLAB_STEP)
+        printf("Error: slab %p on wrong class list %d\n", s, class);
+      if (line_slabs && CACHE_LINE % s->size != 0)
+        printf("Error: slots of slab %p straddle cache lines\n", s);
+      for (nfree = 0, i = 0; i < SLAB_WORDS; i++)
+        nfree += __builtin_popcountl(s->bitmap[i]);
+      if (nfree != s->nfree || nfree == 0)
+        printf("Error: slab %p free count %d, bitmap %d\n", s, s->nfree, nfree);
+      if (s->next && s->next->prev != s)
+        printf("Error: broken slab list links at %p\n", s);
+      count++;
+    }
+  }
+  return count;
+}
+
+/*
+ * checkquick - blocks on a quick list must be marked allocated and have
+ *    the size of their list, and the list lengths must be right
+ */
+static void checkquick(arena_t *a)
+{
+  void *bp;
+  int i, n;
+
+  for (i = 0; i < QL_LISTS; i++) {
+    for (n = 0, bp = a->quick[i]; bp != NULL; bp = QL_NEXT(bp), n++)
+      if (!GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) < i * DSIZE ||
+          GET_SIZE(HDRP(bp)) > i * DSIZE + 2*DSIZE)
+        printf("Error: block %p on wrong quick list %d\n", bp, i);
+    if (n != a->nquick[i] || n > QL_LIMIT)
+      printf("Error: quick list %d holds %d blocks, counted %d\n", i, n, a->nquick[i]);
+  }
+}
+
+/*
+ * checktree - check the subtree at bp, whose keys must lie strictly
+ *    between lo and hi (NULL for unbounded).  Returns its black height.
+ */
+static int checktree(arena_t *a, void *bp, void *lo, void *hi, int *count)
+{
+  int lh, rh;
+
+  if (bp == NULL)
+    return 1;
+  (*count)++;
+  if (GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) < TREE_MIN)
+    printf("Error: block %p does not belong in the tree\n", bp);
+  if ((lo && !tree_less(lo, bp)) || (hi && !tree_less(bp, hi)))
+    printf("Error: tree block %p out of order\n", bp);
+  if ((LEFT(bp) && PARENT(LEFT(bp)) != bp) ||
+      (RIGHT(bp) && PARENT(RIGHT(bp)) != bp))
+    printf("Error: broken tree links at %p\n", bp);
+  if (IS_RED(bp) && (IS_RED(LEFT(bp)) || IS_RED(RIGHT(bp))))
+    printf("Error: red tree block %p has a red child\n", bp);
+  lh = checktree(a, LEFT(bp), lo, bp, count);
+  rh = checktree(a, RIGHT(bp), bp, hi, count);
+  if (lh != rh)
+    printf("Error: unequal black heights below %p\n", bp);
+  return lh + !IS_RED(bp);
+}
+
+/*
+ * mm_calloc
+ */
+void *mm_calloc (size_t nmemb, size_t size)
+{
+  //printf("mm_calloc\n");
+  size_t bytes = nmemb * size;
+  size_t clear = bytes;
+  arena_t *a;
+  void *ptr;
+  if (heap_listp == 0){
+    mm_init();
+  }
+  if (size != 0 && bytes / size != nmemb)
+    return NULL;
+
+  /* fresh mappings are already zero */
+  if (mmap_threshold && bytes > mmap_threshold)
+    return map_alloc(ALIGNMENT, bytes);
+
+  /* small blocks come from slabs or thread caches and are cheap to clear */
+  if (bytes <= (threaded ? TC_MAX : SLAB_MAX)) {
+    if ((ptr = mm_malloc(bytes)) != NULL)
+      memset(ptr, 0, bytes);
+    return ptr;
   }
 
-  ptr = mm_malloc(nmemb*size);
-  memset(ptr, 0, nmemb*size);
+  a = threaded ? arena_get() : &arenas[0];
+  LOCK(a);
+  remote_drain(a);
+  if ((ptr = heap_malloc(a, bytes)) != NULL && (clear = zero_from(ptr)) != 0)
+    PUT(HDRP(ptr), GET(HDRP(ptr)) & ~KNOWN_ZERO);
+  UNLOCK(a);
+  if (ptr != NULL)
+    memset(ptr, 0, MIN(clear ? clear : bytes, bytes));
   return ptr;
 }
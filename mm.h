@@ -4,8 +4,79 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+
+/* Allocate size bytes aligned to align, a power of two.  The slack in
+   front of the payload is reused, and the block is freed or resized
+   like any other. */
+extern void *mm_memalign(size_t align, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t align, size_t size);
+extern void *mm_aligned_alloc(size_t align, size_t size);
+
+/* Allocate size bytes on cache lines of their own, shared with no other
+   block's payload.  Freed like any other block. */
+extern void *mm_malloc_cacheline(size_t size);
+
+/* Payload bytes a block really has, at least what was asked for.  The
+   caller may use all of them.  mm_malloc_usable returns the size of
+   the new block along with it. */
+extern size_t mm_malloc_usable_size(void *ptr);
+extern void *mm_malloc_usable(size_t size, size_t *usable);
+
+/* Allocate n blocks of size bytes into out, returning how many were
+   allocated, and free n blocks at once.  mm_free_batch sorts ptrs. */
+extern int mm_malloc_batch(size_t size, int n, void **out);
+extern void mm_free_batch(void **ptrs, int n);
+
+/* Free ptr, a block the caller asked for size bytes of with mm_malloc,
+   mm_calloc, mm_realloc or mm_malloc_batch.  Saves looking the size up;
+   build with -DDEBUG to have it checked against the block. */
+extern void mm_free_sized(void *ptr, size_t size);
 extern int mm_init(void);
 
+/* Heap growth and fit search statistics, see mm_get_stats */
+typedef struct {
+  unsigned long extends;  /* times the heap has been extended */
+  size_t extend_size;     /* bytes the next extension will ask for */
+  unsigned long probes;   /* free blocks looked at by fit searches */
+} mm_stats_t;
+
+extern void mm_get_stats(mm_stats_t *st);
+
+/* Give free memory at the top of the heap back to the system, keeping
+   pad bytes of it.  Returns 1 if the heap shrank. */
+extern int mm_trim(size_t pad);
+
+/* Serve requests larger than size bytes from regions of their own,
+   unmapped as soon as they are freed.  0 turns this off. */
+extern void mm_set_mmap_threshold(size_t size);
+
+/* Look at up to k more free blocks past the first fit and take the
+   tightest; 0 takes the first fit.  Takes effect at the next mm_init. */
+extern void mm_set_fit_probes(int k);
+
+/* Keep free lists in address order rather than LIFO.  Takes effect at
+   the next mm_init. */
+extern void mm_set_addr_order(int enable);
+
+/* Keep the size of each free block's successor in its list link, so a
+   fit search reads one aligned link pair per block and no headers.
+   Takes effect at the next mm_init. */
+extern void mm_set_packed_sizes(int enable);
+
+/* Round slab slots up to a power of two and start them on a cache line,
+   so that no block of 64 bytes or less straddles a line.  Takes effect
+   at the next mm_init. */
+extern void mm_set_cacheline_slabs(int enable);
+
+/* Make the package safe to call from several threads at once.  Call
+   before mm_init, while no other thread is using the package. */
+extern void mm_set_threaded(int enable);
+
+/* Split the heap into n independent arenas in thread-safe mode, binding
+   threads to them round robin, or by CPU if by_cpu is set.  Takes
+   effect at the next mm_init. */
+extern void mm_set_arenas(int n, int by_cpu);
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);